@@ -0,0 +1,487 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <ctype.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* Batch mode: run many programs to completion on a thread pool  */
+/*                                                                                                                                      */
+/* Each worker has a simulator of its own, reset between programs, and a queue */
+/* of programs; it steals from the back of another worker's queue once its    */
+/* own is empty.                                                                                                           */
+/* Summaries are written into per-program buffers and printed in the order   */
+/* the programs were given, whatever order they finish in.                          */
+/*                                                                                                                                      */
+/* Sweep mode runs one program many times from different initial state on    */
+/* the same pool. The program is loaded once; every worker maps its pages     */
+/* read-only and copies a page only when a run writes to it.                       */
+/***************************************************************/
+
+typedef struct {
+	const char *program;
+	const char *variant;	/* sweep mode: initial-state assignments, applied after reset() */
+	char *summary;		/* filled in by the worker that ran it */
+	size_t summary_size;
+	uint64_t instructions;
+	int loaded;
+	int done;
+} batch_job_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	int head, tail;		/* owner takes from head, thieves from tail */
+	int *jobs;
+} batch_queue_t;
+
+typedef struct {
+	const mips_sim_t *options;	/* engine and state options to copy */
+	const mips_sim_t *image;	/* sweep mode: the loaded program every worker shares */
+	uint32_t max_instructions;
+	batch_job_t *jobs;
+	batch_queue_t *queues;
+	int num_queues;
+
+	pthread_mutex_t done_lock;	/* guards every job's done flag */
+	pthread_cond_t done_cond;
+} batch_t;
+
+typedef struct {
+	batch_t *batch;
+	int id;
+} batch_worker_t;
+
+/***************************************************************/
+/* Next program for worker id: its own queue first, then steal    */
+/***************************************************************/
+static int batch_next_job(batch_t *batch, int id)
+{
+	batch_queue_t *q;
+	int i, job = -1;
+
+	q = &batch->queues[id];
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail) {
+		job = q->jobs[q->head++];
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	for (i = 1; job < 0 && i < batch->num_queues; i++) {
+		q = &batch->queues[(id + i) % batch->num_queues];
+		pthread_mutex_lock(&q->lock);
+		if (q->head < q->tail) {
+			job = q->jobs[--q->tail];
+		}
+		pthread_mutex_unlock(&q->lock);
+	}
+	return job;
+}
+
+/***************************************************************/
+/* FNV-1a over the mapped pages in address order                          */
+/***************************************************************/
+static int compare_pages(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t memory_checksum(mips_sim_t *sim, uint32_t *num_pages)
+{
+	uint32_t *pages, i, j, n, hash = 2166136261u;
+	uint32_t num_shared = sim->IMAGE ? sim->IMAGE->MEM_NUM_DIRTY : 0;
+	uint32_t num_file = sim->IMAGE ? sim->IMAGE->MEM_NUM_FILE : sim->MEM_NUM_FILE;
+	const uint32_t *file_pages = sim->IMAGE ? sim->IMAGE->MEM_FILE_PAGES : sim->MEM_FILE_PAGES;
+
+	/* pages are listed in the order they were first written, which may differ between engines */
+	pages = malloc((sim->MEM_NUM_DIRTY + num_shared + num_file) * sizeof(uint32_t) + 1);
+	if (pages == NULL) {
+		printf("Error: out of memory summarising %s\n", sim->prog_file);
+		exit(-1);
+	}
+	memcpy(pages, sim->MEM_DIRTY_PAGES, sim->MEM_NUM_DIRTY * sizeof(uint32_t));
+	n = sim->MEM_NUM_DIRTY;
+
+	/* image pages this run never wrote are still mapped, shared */
+	for (i = 0; i < num_shared; i++) {
+		if (sim->MEM_WRITE_PAGES[sim->IMAGE->MEM_DIRTY_PAGES[i]] == NULL) {
+			pages[n++] = sim->IMAGE->MEM_DIRTY_PAGES[i];
+		}
+	}
+	/* and so are ELF pages still read from the file */
+	for (i = 0; i < num_file; i++) {
+		if (sim->MEM_PAGES[file_pages[i]] == mem_initial_page(sim, file_pages[i])) {
+			pages[n++] = file_pages[i];
+		}
+	}
+	qsort(pages, n, sizeof(uint32_t), compare_pages);
+
+	for (i = 0; i < n; i++) {
+		hash = (hash ^ pages[i]) * 16777619u;
+		for (j = 0; j < MEM_PAGE_SIZE; j++) {
+			hash = (hash ^ sim->MEM_PAGES[pages[i]][j]) * 16777619u;
+		}
+	}
+	free(pages);
+	*num_pages = n;
+	return hash;
+}
+
+/***************************************************************/
+/* Final registers and memory of one finished program                       */
+/***************************************************************/
+static void print_summary(mips_sim_t *sim, const char *variant, const char *output, size_t output_size, FILE *out)
+{
+	uint32_t num_pages, checksum = memory_checksum(sim, &num_pages);
+	const char *line, *end = output + output_size, *newline;
+	int i;
+
+	if (variant) {
+		fprintf(out, "[%s: %s]", sim->prog_file, variant);
+	} else {
+		fprintf(out, "[%s]", sim->prog_file);
+	}
+	fprintf(out, " %llu instructions, PC 0x%08x, ", (unsigned long long)sim->INSTRUCTION_COUNT, sim->CURRENT_STATE.PC);
+	if (sim->RUN_FLAG) {
+		fprintf(out, "instruction limit reached\n");
+	} else if (sim->EXIT_CODE) {
+		fprintf(out, "exited with code %d\n", sim->EXIT_CODE);
+	} else {
+		fprintf(out, "finished\n");
+	}
+	/* the program's own output, one marked line per line it printed */
+	for (line = output; line < end; line = newline + 1) {
+		if ((newline = memchr(line, '\n', end - line)) == NULL) {
+			newline = end;
+		}
+		fprintf(out, "\t> %.*s\n", (int)(newline - line), line);
+	}
+	for (i = 0; i < MIPS_REGS; i++) {
+		fprintf(out, "%sR%-2d 0x%08x", i % 4 ? "  " : "\t", i, sim->CURRENT_STATE.REGS[i]);
+		if (i % 4 == 3) {
+			fprintf(out, "\n");
+		}
+	}
+	fprintf(out, "\tHI  0x%08x  LO  0x%08x\n", sim->CURRENT_STATE.HI, sim->CURRENT_STATE.LO);
+	fprintf(out, "\tmemory: %u pages mapped, checksum 0x%08x\n", num_pages, checksum);
+	if (sim->ENGINE == ENGINE_PIPELINE || sim->SAMPLE_WINDOW) {
+		fprintf(out, "\t");
+		pipe_report(sim, out);
+	}
+	if (sim->NUM_BPRED) {
+		fprintf(out, "\t");
+		bpred_report(sim, out);
+	}
+}
+
+/***************************************************************/
+/* Apply a sweep variant: R<n>=v, HI=v, LO=v and [address]=word, */
+/* separated by blanks; returns the offending token on error            */
+/***************************************************************/
+static const char *apply_variant(mips_sim_t *sim, const char *variant, char *token, size_t size)
+{
+	const char *p = variant;
+	char *end;
+	uint32_t address, value;
+	int n, reg;
+
+	while (sscanf(p, " %n", &n) == 0 && p[n] != '\0') {
+		p += n;
+		for (n = 0; p[n] != '\0' && !isspace((unsigned char)p[n]); n++);
+		snprintf(token, size, "%.*s", n, p);
+		p += n;
+
+		end = strchr(token, '=');
+		if (end == NULL || end[1] == '\0') {
+			return token;
+		}
+		value = (uint32_t)strtoll(end + 1, &end, 0);
+		if (*end != '\0') {
+			return token;
+		}
+
+		if ((token[0] == 'R' || token[0] == 'r') && sscanf(token + 1, "%d%n", &reg, &n) == 1 && token[1 + n] == '=') {
+			/* $0 is hard-wired to zero */
+			if (reg <= 0 || reg >= MIPS_REGS) {
+				return token;
+			}
+			sim->CURRENT_STATE.REGS[reg] = value;
+		} else if (strncasecmp(token, "HI=", 3) == 0) {
+			sim->CURRENT_STATE.HI = value;
+		} else if (strncasecmp(token, "LO=", 3) == 0) {
+			sim->CURRENT_STATE.LO = value;
+		} else if (token[0] == '[' && (address = strtoul(token + 1, &end, 0), strncmp(end, "]=", 2) == 0) && end > token + 1) {
+			/* copies the page if it is shared with the image */
+			mem_write_32(sim, address, value);
+		} else {
+			return token;
+		}
+	}
+	sim->NEXT_STATE = sim->CURRENT_STATE;
+	return NULL;
+}
+
+/***************************************************************/
+/* Load, run and summarise one program on the worker's simulator     */
+/***************************************************************/
+static void batch_run_job(mips_sim_t *sim, batch_t *batch, batch_job_t *job)
+{
+	FILE *out = open_memstream(&job->summary, &job->summary_size);
+	const char *bad;
+	char token[64], *output;
+	size_t output_size;
+
+	if (out == NULL) {
+		printf("Error: out of memory running %s\n", job->program);
+		exit(-1);
+	}
+	snprintf(sim->prog_file, sizeof(sim->prog_file), "%s", job->program);
+
+	/* reset() only clears what the previous program touched, far cheaper than a new simulator */
+	if (!reset(sim)) {
+		fprintf(out, "[%s] %s\n", job->program, sim->LOAD_ERROR);
+	} else if (job->variant && (bad = apply_variant(sim, job->variant, token, sizeof(token))) != NULL) {
+		fprintf(out, "[%s: %s] bad assignment %s\n", job->program, job->variant, bad);
+	} else {
+		/* the program's own output goes in its summary, after its first line */
+		sim->GUEST_OUT = open_memstream(&output, &output_size);
+		if (sim->GUEST_OUT == NULL) {
+			printf("Error: out of memory running %s\n", job->program);
+			exit(-1);
+		}
+		run_to_completion(sim, batch->max_instructions);
+		fclose(sim->GUEST_OUT);
+		sim->GUEST_OUT = NULL;
+		print_summary(sim, job->variant, output, output_size, out);
+		free(output);
+		job->instructions = sim->INSTRUCTION_COUNT;
+		job->loaded = TRUE;
+	}
+	fclose(out);
+}
+
+static void *batch_worker(void *arg)
+{
+	batch_worker_t *worker = arg;
+	batch_t *batch = worker->batch;
+	mips_sim_t *sim = sim_create();
+	int job;
+
+	sim->ENGINE = batch->options->ENGINE;
+	sim->STATE_IN_PLACE = batch->options->STATE_IN_PLACE;
+	sim->PIPE_FORWARDING = batch->options->PIPE_FORWARDING;
+	sim->SAMPLE_SKIP = batch->options->SAMPLE_SKIP;
+	sim->SAMPLE_WINDOW = batch->options->SAMPLE_WINDOW;
+	sim->BPRED_SPEC = batch->options->BPRED_SPEC;
+	sim->BTB_ENTRIES = batch->options->BTB_ENTRIES;
+	if (sim->BPRED_SPEC) {
+		bpred_init(sim);	/* main already parsed the same list */
+	}
+	sim->QUIET = TRUE;
+	sim->NO_GUEST_INPUT = TRUE;
+	sim->IMAGE = batch->image;
+
+	while ((job = batch_next_job(batch, worker->id)) >= 0) {
+		batch_run_job(sim, batch, &batch->jobs[job]);
+
+		pthread_mutex_lock(&batch->done_lock);
+		batch->jobs[job].done = TRUE;
+		pthread_cond_broadcast(&batch->done_cond);
+		pthread_mutex_unlock(&batch->done_lock);
+	}
+	sim_destroy(sim);
+	return NULL;
+}
+
+/***************************************************************/
+/* Run every job on the pool; returns the process exit status          */
+/***************************************************************/
+static int batch_run_all(const mips_sim_t *options, const mips_sim_t *image, batch_job_t *jobs, int num_programs,
+			 int num_threads, uint32_t max_instructions)
+{
+	batch_t batch;
+	batch_worker_t *workers;
+	pthread_t *threads;
+	struct timespec start, stop;
+	uint64_t total_instructions = 0;
+	double seconds;
+	int i, first, failed = 0;
+
+	if (num_threads <= 0) {
+		num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (num_threads > num_programs) {
+		num_threads = num_programs;
+	}
+	if (num_threads <= 0) {
+		num_threads = 1;
+	}
+
+	memset(&batch, 0, sizeof(batch));
+	batch.options = options;
+	batch.image = image;
+	batch.max_instructions = max_instructions;
+	batch.num_queues = num_threads;
+	batch.jobs = jobs;
+	batch.queues = calloc(num_threads, sizeof(batch_queue_t));
+	workers = calloc(num_threads, sizeof(batch_worker_t));
+	threads = calloc(num_threads, sizeof(pthread_t));
+	if (batch.jobs == NULL || batch.queues == NULL || workers == NULL || threads == NULL) {
+		printf("Error: out of memory starting the batch\n");
+		exit(-1);
+	}
+	pthread_mutex_init(&batch.done_lock, NULL);
+	pthread_cond_init(&batch.done_cond, NULL);
+
+	/* each worker starts with a contiguous slice, so in-order output can usually be
+	 * printed while later programs are still running */
+	for (i = 0; i < num_threads; i++) {
+		batch_queue_t *q = &batch.queues[i];
+		pthread_mutex_init(&q->lock, NULL);
+		q->jobs = malloc(num_programs * sizeof(int));
+		if (q->jobs == NULL) {
+			printf("Error: out of memory starting the batch\n");
+			exit(-1);
+		}
+		first = (int)((int64_t)i * num_programs / num_threads);
+		for (q->tail = 0; first + q->tail < (int)((int64_t)(i + 1) * num_programs / num_threads); q->tail++) {
+			q->jobs[q->tail] = first + q->tail;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < num_threads; i++) {
+		workers[i].batch = &batch;
+		workers[i].id = i;
+		if (pthread_create(&threads[i], NULL, batch_worker, &workers[i]) != 0) {
+			printf("Error: can't start batch thread %d\n", i);
+			exit(-1);
+		}
+	}
+
+	/* print each summary as soon as it and everything before it are done */
+	for (i = 0; i < num_programs; i++) {
+		pthread_mutex_lock(&batch.done_lock);
+		while (!batch.jobs[i].done) {
+			pthread_cond_wait(&batch.done_cond, &batch.done_lock);
+		}
+		pthread_mutex_unlock(&batch.done_lock);
+
+		fwrite(batch.jobs[i].summary, 1, batch.jobs[i].summary_size, stdout);
+		free(batch.jobs[i].summary);
+		total_instructions += batch.jobs[i].instructions;
+		failed |= !batch.jobs[i].loaded;
+	}
+	fflush(stdout);
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	/* timing varies run to run, so it stays off stdout */
+	seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "%d %s on %d threads: %llu instructions in %.3f s (%.1f MIPS)\n", num_programs, image ? "variants" : "programs", num_threads,
+		(unsigned long long)total_instructions, seconds, seconds > 0 ? total_instructions / seconds / 1e6 : 0.0);
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_mutex_destroy(&batch.queues[i].lock);
+		free(batch.queues[i].jobs);
+	}
+	pthread_mutex_destroy(&batch.done_lock);
+	pthread_cond_destroy(&batch.done_cond);
+	free(batch.queues);
+	free(workers);
+	free(threads);
+	return failed ? 1 : 0;
+}
+
+/***************************************************************/
+/* Run every program; returns the process exit status                    */
+/***************************************************************/
+int run_batch(const mips_sim_t *options, int num_programs, char **programs, int num_threads, uint32_t max_instructions)
+{
+	batch_job_t *jobs = calloc(num_programs, sizeof(batch_job_t));
+	int i, status;
+
+	if (jobs == NULL) {
+		printf("Error: out of memory starting the batch\n");
+		exit(-1);
+	}
+	for (i = 0; i < num_programs; i++) {
+		jobs[i].program = programs[i];
+	}
+	status = batch_run_all(options, NULL, jobs, num_programs, num_threads, max_instructions);
+	free(jobs);
+	return status;
+}
+
+/***************************************************************/
+/* Run the program in sim once per line of the variant table, each    */
+/* from its own initial state; returns the process exit status          */
+/***************************************************************/
+int run_sweep(mips_sim_t *sim, const char *table_file, int num_threads, uint32_t max_instructions)
+{
+	FILE *table;
+	batch_job_t *jobs = NULL;
+	char *line = NULL, *variant;
+	size_t line_size = 0;
+	int i, len, num_variants = 0, capacity = 0, status;
+
+	table = fopen(table_file, "r");
+	if (table == NULL) {
+		printf("Error: Can't open variant table %s\n", table_file);
+		return 1;
+	}
+
+	/* one variant per line; blank lines and # comments are skipped */
+	while (getline(&line, &line_size, table) != -1) {
+		variant = line + strspn(line, " \t");
+		len = (int)strcspn(variant, "#\r\n");
+		while (len > 0 && isspace((unsigned char)variant[len - 1])) {
+			len--;
+		}
+		if (len == 0) {
+			continue;
+		}
+		if (num_variants == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			jobs = realloc(jobs, capacity * sizeof(batch_job_t));
+		}
+		if (jobs == NULL || (variant = strndup(variant, len)) == NULL) {
+			printf("Error: out of memory reading %s\n", table_file);
+			exit(-1);
+		}
+		memset(&jobs[num_variants], 0, sizeof(batch_job_t));
+		jobs[num_variants].program = sim->prog_file;
+		jobs[num_variants].variant = variant;
+		num_variants++;
+	}
+	free(line);
+	fclose(table);
+	if (num_variants == 0) {
+		printf("Error: no variants in %s\n", table_file);
+		free(jobs);
+		return 1;
+	}
+
+	/* parse the program once; the workers share its pages and never write to them */
+	sim->QUIET = TRUE;
+	if (!reset(sim)) {
+		printf("Error: Can't open program file %s\n", sim->prog_file);
+		status = 1;
+	} else {
+		status = batch_run_all(sim, sim, jobs, num_variants, num_threads, max_instructions);
+	}
+
+	for (i = 0; i < num_variants; i++) {
+		free((char *)jobs[i].variant);
+	}
+	free(jobs);
+	return status;
+}
@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* Branch predictors                                                                                                      */
+/*                                                                                                                                      */
+/* -bp takes a comma-separated list of predictors, each name[:bits]:               */
+/*	not-taken, taken, btfn	static; btfn predicts backward branches taken     */
+/*	bimodal:<bits>		2-bit counters indexed by PC                               */
+/*	gshare:<bits>		2-bit counters indexed by PC xor global history      */
+/*	tournament:<bits>	bimodal and gshare, chosen per PC by 2-bit counters */
+/* All of them see every branch and jump, so one run compares them; the first */
+/* also steers fetch in the pipeline engine.                                               */
+/*                                                                                                                                      */
+/* -btb <entries> gives each predictor a direct-mapped branch target buffer:  */
+/* a taken prediction then needs a BTB hit, and jr/jalr are predicted from it */
+/* alone. Without one, direct targets are taken from the decoded instruction   */
+/* and register jumps are always predicted to fall through.                          */
+/*                                                                                                                                      */
+/* With no -bp the engines skip all of this on a single flag test.                 */
+/***************************************************************/
+
+enum { BP_NOT_TAKEN, BP_TAKEN, BP_BTFN, BP_BIMODAL, BP_GSHARE, BP_TOURNAMENT };
+
+#define BP_DEFAULT_BITS 12
+#define BP_MAX_BITS     24
+
+struct bpred_struct {
+	int kind;		/* BP_* */
+	char name[48];
+	uint32_t mask;		/* (1 << bits) - 1 */
+	uint8_t *counters;	/* bimodal, gshare, and the tournament's bimodal side */
+	uint8_t *global;	/* the tournament's gshare side */
+	uint8_t *chooser;	/* tournament: >= 2 trusts the gshare side */
+	uint32_t history;	/* global outcomes of the conditional branches, newest in bit 0 */
+
+	uint32_t *btb_pc, *btb_target;	/* NULL without a BTB */
+	uint32_t btb_mask;
+
+	uint64_t branches, branch_misses;	/* conditional branches */
+	uint64_t jumps, jump_misses;		/* j, jal, jr, jalr */
+};
+
+static const struct {
+	const char *name;
+	int kind;
+} BP_KINDS[] = {
+	{ "not-taken", BP_NOT_TAKEN }, { "taken", BP_TAKEN }, { "btfn", BP_BTFN },
+	{ "bimodal", BP_BIMODAL }, { "gshare", BP_GSHARE }, { "tournament", BP_TOURNAMENT },
+};
+
+static uint8_t *bp_table(uint32_t entries)
+{
+	uint8_t *table = malloc(entries);
+
+	if (table == NULL) {
+		printf("Error: out of memory allocating a branch predictor\n");
+		exit(-1);
+	}
+	return table;
+}
+
+/***************************************************************/
+/* Back to the state of a fresh predictor, statistics included          */
+/***************************************************************/
+static void bp_clear(bpred_t *bp)
+{
+	uint32_t entries = bp->mask + 1;
+
+	/* counters start weakly not-taken; the chooser weakly favours bimodal */
+	if (bp->counters) memset(bp->counters, 1, entries);
+	if (bp->global)   memset(bp->global, 1, entries);
+	if (bp->chooser)  memset(bp->chooser, 1, entries);
+	if (bp->btb_pc) {
+		/* no instruction lives at an odd address, so this marks an empty entry */
+		memset(bp->btb_pc, 0xFF, (bp->btb_mask + 1) * sizeof(uint32_t));
+	}
+	bp->history = 0;
+	bp->branches = bp->branch_misses = 0;
+	bp->jumps = bp->jump_misses = 0;
+}
+
+/***************************************************************/
+/* Build sim's predictors from BPRED_SPEC; FALSE if it doesn't parse */
+/***************************************************************/
+int bpred_init(mips_sim_t *sim)
+{
+	const char *p = sim->BPRED_SPEC;
+	bpred_t *bp;
+	char name[32];
+	unsigned bits;
+	int i, n, count;
+
+	for (count = 1, n = 0; p[n]; n++) {
+		count += p[n] == ',';
+	}
+	sim->BPRED = calloc(count, sizeof(bpred_t));
+	if (sim->BPRED == NULL) {
+		printf("Error: out of memory allocating branch predictors\n");
+		exit(-1);
+	}
+
+	for (sim->NUM_BPRED = 0; sim->NUM_BPRED < count; sim->NUM_BPRED++) {
+		bp = &sim->BPRED[sim->NUM_BPRED];
+		bits = BP_DEFAULT_BITS;
+		n = (int)strcspn(p, ":,");
+		snprintf(name, sizeof(name), "%.*s", n, p);
+		p += n;
+		if (*p == ':' && (sscanf(p + 1, "%u%n", &bits, &n) != 1 || bits < 1 || bits > BP_MAX_BITS)) {
+			printf("Error: bad table size in branch predictor %s\n", name);
+			return FALSE;
+		}
+		if (*p == ':') {
+			p += 1 + n;
+		}
+		if (*p == ',') {
+			p++;
+		} else if (*p != '\0') {
+			printf("Error: can't parse branch predictor list at %s\n", p);
+			return FALSE;
+		}
+
+		bp->kind = -1;
+		for (i = 0; i < sizeof(BP_KINDS) / sizeof(BP_KINDS[0]); i++) {
+			if (strcmp(name, BP_KINDS[i].name) == 0) {
+				bp->kind = BP_KINDS[i].kind;
+			}
+		}
+		if (bp->kind < 0) {
+			printf("Error: unknown branch predictor %s\n", name);
+			return FALSE;
+		}
+
+		if (bp->kind >= BP_BIMODAL) {
+			snprintf(bp->name, sizeof(bp->name), "%s:%u", name, bits);
+			bp->mask = (1u << bits) - 1;
+			bp->counters = bp_table(bp->mask + 1);
+			if (bp->kind == BP_TOURNAMENT) {
+				bp->global = bp_table(bp->mask + 1);
+				bp->chooser = bp_table(bp->mask + 1);
+			}
+		} else {
+			snprintf(bp->name, sizeof(bp->name), "%s", name);
+		}
+
+		if (sim->BTB_ENTRIES) {
+			for (bp->btb_mask = 1; bp->btb_mask < sim->BTB_ENTRIES; bp->btb_mask <<= 1);
+			bp->btb_mask--;
+			bp->btb_pc = malloc((bp->btb_mask + 1) * sizeof(uint32_t));
+			bp->btb_target = calloc(bp->btb_mask + 1, sizeof(uint32_t));
+			if (bp->btb_pc == NULL || bp->btb_target == NULL) {
+				printf("Error: out of memory allocating a branch target buffer\n");
+				exit(-1);
+			}
+		}
+		bp_clear(bp);
+	}
+	return TRUE;
+}
+
+void bpred_reset(mips_sim_t *sim)
+{
+	int i;
+
+	for (i = 0; i < sim->NUM_BPRED; i++) {
+		bp_clear(&sim->BPRED[i]);
+	}
+}
+
+void bpred_free(mips_sim_t *sim)
+{
+	int i;
+
+	for (i = 0; i < sim->NUM_BPRED; i++) {
+		free(sim->BPRED[i].counters);
+		free(sim->BPRED[i].global);
+		free(sim->BPRED[i].chooser);
+		free(sim->BPRED[i].btb_pc);
+		free(sim->BPRED[i].btb_target);
+	}
+	free(sim->BPRED);
+	sim->BPRED = NULL;
+	sim->NUM_BPRED = 0;
+}
+
+static void bp_train(uint8_t *counter, int taken)
+{
+	if (taken && *counter < 3) {
+		(*counter)++;
+	} else if (!taken && *counter > 0) {
+		(*counter)--;
+	}
+}
+
+/***************************************************************/
+/* One predictor's guess at the address after pc, then its update   */
+/***************************************************************/
+static int bp_resolve(bpred_t *bp, const decoded_inst_t *d, uint32_t pc, uint32_t next_pc)
+{
+	uint32_t local = (pc >> 2) & bp->mask, shared = ((pc >> 2) ^ bp->history) & bp->mask;
+	uint32_t slot = (pc >> 2) & bp->btb_mask;
+	uint32_t target, predicted = pc + 4;
+	int conditional = OP_CLASS[d->op] == CLASS_BRANCH;
+	int indirect = d->op == OP_jr || d->op == OP_jalr;
+	int taken = TRUE, use_global, correct;
+
+	if (conditional) {
+		switch (bp->kind) {
+			case BP_NOT_TAKEN:  taken = FALSE; break;
+			case BP_TAKEN:      taken = TRUE; break;
+			case BP_BTFN:       taken = d->imm <= pc; break;
+			case BP_BIMODAL:    taken = bp->counters[local] >= 2; break;
+			case BP_GSHARE:     taken = bp->counters[shared] >= 2; break;
+			case BP_TOURNAMENT:
+				taken = bp->chooser[local] >= 2 ? bp->global[shared] >= 2 : bp->counters[local] >= 2;
+				break;
+		}
+	}
+	if (taken) {
+		if (bp->btb_pc) {
+			target = bp->btb_pc[slot] == pc ? bp->btb_target[slot] : pc + 4;
+		} else {
+			target = indirect ? pc + 4 : d->imm;
+		}
+		predicted = target;
+	}
+	correct = predicted == next_pc;
+
+	/* train on the outcome */
+	if (conditional) {
+		taken = next_pc != pc + 4;
+		switch (bp->kind) {
+			case BP_BIMODAL: bp_train(&bp->counters[local], taken); break;
+			case BP_GSHARE:  bp_train(&bp->counters[shared], taken); break;
+			case BP_TOURNAMENT:
+				use_global = (bp->global[shared] >= 2) == taken;
+				if (use_global != ((bp->counters[local] >= 2) == taken)) {
+					bp_train(&bp->chooser[local], use_global);
+				}
+				bp_train(&bp->global[shared], taken);
+				bp_train(&bp->counters[local], taken);
+				break;
+		}
+		bp->history = (bp->history << 1) | taken;
+		bp->branches++;
+		bp->branch_misses += !correct;
+	} else {
+		bp->jumps++;
+		bp->jump_misses += !correct;
+	}
+	if (bp->btb_pc && next_pc != pc + 4) {
+		bp->btb_pc[slot] = pc;
+		bp->btb_target[slot] = next_pc;
+	}
+	return correct;
+}
+
+/***************************************************************/
+/* Show every predictor the branch or jump at pc, which went to       */
+/* next_pc; returns whether the first one predicted it                       */
+/***************************************************************/
+int bpred_resolve(mips_sim_t *sim, const decoded_inst_t *d, uint32_t pc, uint32_t next_pc)
+{
+	int i, first = bp_resolve(&sim->BPRED[0], d, pc, next_pc);
+
+	for (i = 1; i < sim->NUM_BPRED; i++) {
+		bp_resolve(&sim->BPRED[i], d, pc, next_pc);
+	}
+	return first;
+}
+
+/***************************************************************/
+/* Misprediction rate and MPKI of each predictor                            */
+/***************************************************************/
+void bpred_report(mips_sim_t *sim, FILE *out)
+{
+	const bpred_t *bp;
+	uint64_t misses;
+	int i;
+
+	fprintf(out, "Branch prediction (%u-entry BTB):\n", sim->BTB_ENTRIES ? sim->BPRED[0].btb_mask + 1 : 0);
+	for (i = 0; i < sim->NUM_BPRED; i++) {
+		bp = &sim->BPRED[i];
+		misses = bp->branch_misses + bp->jump_misses;
+		fprintf(out, "\t%-16s branches %llu/%llu mispredicted (%.2f%%), jumps %llu/%llu, MPKI %.3f\n", bp->name,
+			(unsigned long long)bp->branch_misses, (unsigned long long)bp->branches,
+			bp->branches ? 100.0 * bp->branch_misses / bp->branches : 0.0,
+			(unsigned long long)bp->jump_misses, (unsigned long long)bp->jumps,
+			sim->INSTRUCTION_COUNT ? 1000.0 * misses / sim->INSTRUCTION_COUNT : 0.0);
+	}
+}
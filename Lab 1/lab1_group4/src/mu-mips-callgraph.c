@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* Guest call graph                                                                                                        */
+/*                                                                                                                                      */
+/* jal, and jalr writing $31, are calls; jr $31 is a return. The engines show */
+/* every jump to callgraph_jump(), which keeps a shadow stack of the calls    */
+/* still open and grows a tree with one node per distinct call path. Each    */
+/* node counts the instructions retired while it was on top of the stack, so */
+/* a node is one line of folded-stack output and a function's exclusive and   */
+/* inclusive counts are sums over its nodes.                                           */
+/*                                                                                                                                      */
+/* Functions are named by their entry address; the root is wherever the PC   */
+/* was when the graph started.                                                               */
+/***************************************************************/
+
+#define CALLS_TOP_FUNCTIONS 20
+#define CALLS_RETURN_SEARCH 16	/* frames a return may unwind to find its caller */
+
+typedef struct {
+	uint32_t func;		/* entry address */
+	uint32_t parent;	/* node indices; a child always comes after its parent */
+	uint32_t first_child, next_sibling;	/* 0 ends the list, the root is never a child */
+	uint64_t calls;		/* times this path was entered */
+	uint64_t self;		/* instructions retired with this path on top */
+} call_node_t;
+
+typedef struct {
+	uint32_t node;
+	uint32_t return_pc;	/* where the matching jr $31 goes */
+} call_frame_t;
+
+struct callgraph_struct {
+	call_node_t *nodes;
+	uint32_t num_nodes, node_capacity;
+	call_frame_t *stack;	/* stack[0] is the root and is never popped */
+	uint32_t depth, stack_capacity;
+	uint64_t mark;		/* instruction count up to which self counts are settled */
+	uint64_t lost_returns;	/* jr $31 that matched no open call */
+};
+
+typedef struct {
+	uint32_t func;
+	uint64_t calls, self, inclusive;
+} call_func_t;
+
+static void *calls_grow(void *array, uint32_t *capacity, size_t size)
+{
+	*capacity = *capacity ? 2 * *capacity : 256;
+	array = realloc(array, *capacity * size);
+	if (array == NULL) {
+		printf("Error: out of memory growing the call graph\n");
+		exit(-1);
+	}
+	return array;
+}
+
+/***************************************************************/
+/* Start an empty graph rooted at the current PC                           */
+/***************************************************************/
+void callgraph_reset(mips_sim_t *sim)
+{
+	callgraph_t *cg = sim->CALLGRAPH;
+
+	if (cg->node_capacity == 0) {
+		cg->nodes = calls_grow(cg->nodes, &cg->node_capacity, sizeof(call_node_t));
+	}
+	if (cg->stack_capacity == 0) {
+		cg->stack = calls_grow(cg->stack, &cg->stack_capacity, sizeof(call_frame_t));
+	}
+	memset(&cg->nodes[0], 0, sizeof(call_node_t));
+	cg->nodes[0].func = sim->CURRENT_STATE.PC;
+	cg->nodes[0].calls = 1;
+	cg->num_nodes = 1;
+	cg->stack[0].node = 0;
+	cg->stack[0].return_pc = 1;	/* odd, so no return ever matches it */
+	cg->depth = 1;
+	cg->mark = sim->INSTRUCTION_COUNT;
+	cg->lost_returns = 0;
+}
+
+void callgraph_init(mips_sim_t *sim)
+{
+	sim->CALLGRAPH = calloc(1, sizeof(callgraph_t));
+	if (sim->CALLGRAPH == NULL) {
+		printf("Error: out of memory allocating the call graph\n");
+		exit(-1);
+	}
+	callgraph_reset(sim);
+}
+
+void callgraph_free(mips_sim_t *sim)
+{
+	if (sim->CALLGRAPH) {
+		free(sim->CALLGRAPH->nodes);
+		free(sim->CALLGRAPH->stack);
+		free(sim->CALLGRAPH);
+		sim->CALLGRAPH = NULL;
+	}
+}
+
+/* hand the instructions retired since the last event to the path on top of the stack */
+static void calls_settle(callgraph_t *cg, uint64_t retired)
+{
+	cg->nodes[cg->stack[cg->depth - 1].node].self += retired - cg->mark;
+	cg->mark = retired;
+}
+
+/***************************************************************/
+/* The jump d at pc went to next_pc; retired counts it, and every     */
+/* instruction before it                                                                              */
+/***************************************************************/
+void callgraph_jump(mips_sim_t *sim, const decoded_inst_t *d, uint32_t pc, uint32_t next_pc, uint64_t retired)
+{
+	callgraph_t *cg = sim->CALLGRAPH;
+	uint32_t parent, child, i;
+
+	if (d->op == OP_jal || (d->op == OP_jalr && d->rd == 31)) {
+		/* the call itself belongs to the caller */
+		calls_settle(cg, retired);
+		parent = cg->stack[cg->depth - 1].node;
+		for (child = cg->nodes[parent].first_child; child; child = cg->nodes[child].next_sibling) {
+			if (cg->nodes[child].func == next_pc) {
+				break;
+			}
+		}
+		if (child == 0) {
+			if (cg->num_nodes == cg->node_capacity) {
+				cg->nodes = calls_grow(cg->nodes, &cg->node_capacity, sizeof(call_node_t));
+			}
+			child = cg->num_nodes++;
+			memset(&cg->nodes[child], 0, sizeof(call_node_t));
+			cg->nodes[child].func = next_pc;
+			cg->nodes[child].parent = parent;
+			cg->nodes[child].next_sibling = cg->nodes[parent].first_child;
+			cg->nodes[parent].first_child = child;
+		}
+		cg->nodes[child].calls++;
+
+		if (cg->depth == cg->stack_capacity) {
+			cg->stack = calls_grow(cg->stack, &cg->stack_capacity, sizeof(call_frame_t));
+		}
+		cg->stack[cg->depth].node = child;
+		cg->stack[cg->depth].return_pc = pc + 4;
+		cg->depth++;
+	} else if (d->op == OP_jr && d->rs == 31) {
+		/* the return belongs to the callee; a caller a few frames down means the
+		 * frames above it left some other way (longjmp, a tail call through jr) */
+		for (i = cg->depth - 1; i > 0 && cg->depth - i <= CALLS_RETURN_SEARCH; i--) {
+			if (cg->stack[i].return_pc == next_pc) {
+				calls_settle(cg, retired);
+				cg->depth = i;
+				return;
+			}
+		}
+		cg->lost_returns++;
+	}
+}
+
+static int compare_funcs_by_address(const void *a, const void *b)
+{
+	const call_func_t *x = a, *y = b;
+
+	return x->func < y->func ? -1 : x->func > y->func;
+}
+
+static int compare_funcs_by_inclusive(const void *a, const void *b)
+{
+	const call_func_t *x = a, *y = b;
+
+	if (x->inclusive != y->inclusive) {
+		return x->inclusive < y->inclusive ? 1 : -1;
+	}
+	return x->func < y->func ? -1 : x->func > y->func;
+}
+
+/***************************************************************/
+/* Per-function call counts and inclusive/exclusive instructions         */
+/***************************************************************/
+void callgraph_report(mips_sim_t *sim)
+{
+	callgraph_t *cg = sim->CALLGRAPH;
+	call_func_t *funcs, key, *f;
+	uint64_t *inclusive;
+	uint32_t *func_of, *active, *walk;
+	uint32_t num_funcs, n, i, top;
+	uint64_t total;
+
+	calls_settle(cg, sim->INSTRUCTION_COUNT);
+
+	funcs = malloc(cg->num_nodes * sizeof(call_func_t));
+	inclusive = malloc(cg->num_nodes * sizeof(uint64_t));
+	func_of = malloc(cg->num_nodes * sizeof(uint32_t));
+	walk = malloc(2 * cg->num_nodes * sizeof(uint32_t));
+	if (funcs == NULL || inclusive == NULL || func_of == NULL || walk == NULL) {
+		printf("Error: out of memory building the call graph report\n");
+		exit(-1);
+	}
+
+	/* children come after their parents, so one backward pass sums every subtree */
+	for (n = 0; n < cg->num_nodes; n++) {
+		inclusive[n] = cg->nodes[n].self;
+	}
+	for (n = cg->num_nodes - 1; n > 0; n--) {
+		inclusive[cg->nodes[n].parent] += inclusive[n];
+	}
+	total = inclusive[0];
+
+	/* one entry per distinct entry address */
+	for (n = 0; n < cg->num_nodes; n++) {
+		funcs[n].func = cg->nodes[n].func;
+	}
+	qsort(funcs, cg->num_nodes, sizeof(call_func_t), compare_funcs_by_address);
+	for (num_funcs = 0, n = 0; n < cg->num_nodes; n++) {
+		if (num_funcs == 0 || funcs[num_funcs - 1].func != funcs[n].func) {
+			funcs[num_funcs].func = funcs[n].func;
+			funcs[num_funcs].calls = funcs[num_funcs].self = funcs[num_funcs].inclusive = 0;
+			num_funcs++;
+		}
+	}
+	active = calloc(num_funcs, sizeof(uint32_t));
+	if (active == NULL) {
+		printf("Error: out of memory building the call graph report\n");
+		exit(-1);
+	}
+	for (n = 0; n < cg->num_nodes; n++) {
+		key.func = cg->nodes[n].func;
+		f = bsearch(&key, funcs, num_funcs, sizeof(call_func_t), compare_funcs_by_address);
+		func_of[n] = f - funcs;
+		f->calls += cg->nodes[n].calls;
+		f->self += cg->nodes[n].self;
+	}
+
+	/* a recursive function's inclusive count only takes its outermost frames, so walk
+	 * the tree depth first counting how many frames of each function are open; a node
+	 * is pushed once on the way down and again, with the top bit set, to close it */
+	top = 0;
+	walk[top++] = 0;
+	while (top) {
+		n = walk[--top];
+		if (n & 0x80000000u) {
+			active[func_of[n & 0x7FFFFFFFu]]--;
+			continue;
+		}
+		if (active[func_of[n]]++ == 0) {
+			funcs[func_of[n]].inclusive += inclusive[n];
+		}
+		walk[top++] = n | 0x80000000u;
+		for (i = cg->nodes[n].first_child; i; i = cg->nodes[i].next_sibling) {
+			walk[top++] = i;
+		}
+	}
+
+	qsort(funcs, num_funcs, sizeof(call_func_t), compare_funcs_by_inclusive);
+	printf("Call graph: %u functions, %u call paths", num_funcs, cg->num_nodes);
+	if (cg->lost_returns) {
+		printf(", %llu returns matched no open call", (unsigned long long)cg->lost_returns);
+	}
+	printf("\n\t[Function]\t    Calls\t Inclusive\t  %%\t Exclusive\t  %%\n");
+	for (i = 0; i < num_funcs && i < CALLS_TOP_FUNCTIONS; i++) {
+		f = &funcs[i];
+		printf("\t[0x%08x]\t%9llu\t%10llu\t%5.1f\t%10llu\t%5.1f\n", f->func, (unsigned long long)f->calls,
+		       (unsigned long long)f->inclusive, total ? 100.0 * f->inclusive / total : 0.0,
+		       (unsigned long long)f->self, total ? 100.0 * f->self / total : 0.0);
+	}
+	printf("\n");
+
+	free(funcs);
+	free(inclusive);
+	free(func_of);
+	free(walk);
+	free(active);
+}
+
+/***************************************************************/
+/* One "caller;...;callee count" line per path with exclusive          */
+/* instructions, the folded format flame graph tools read                   */
+/***************************************************************/
+int callgraph_write_folded(mips_sim_t *sim, const char *file)
+{
+	callgraph_t *cg = sim->CALLGRAPH;
+	FILE *out;
+	uint32_t *path, depth, n, i;
+
+	calls_settle(cg, sim->INSTRUCTION_COUNT);
+	if ((out = fopen(file, "w")) == NULL) {
+		printf("Error: Can't write call stacks to %s\n", file);
+		return FALSE;
+	}
+	/* recursion can make paths as deep as the tree is big */
+	path = malloc(cg->num_nodes * sizeof(uint32_t));
+	if (path == NULL) {
+		printf("Error: out of memory writing call stacks\n");
+		exit(-1);
+	}
+	for (n = 0; n < cg->num_nodes; n++) {
+		if (cg->nodes[n].self == 0) {
+			continue;
+		}
+		for (depth = 0, i = n; i != 0; i = cg->nodes[i].parent) {
+			path[depth++] = i;
+		}
+		fprintf(out, "0x%08x", cg->nodes[0].func);
+		while (depth) {
+			fprintf(out, ";0x%08x", cg->nodes[path[--depth]].func);
+		}
+		fprintf(out, " %llu\n", (unsigned long long)cg->nodes[n].self);
+	}
+	free(path);
+	fclose(out);
+	return TRUE;
+}
@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* Static MIPS32 ELF executables                                                                                   */
+/*                                                                                                                                      */
+/* The file is mapped read-only, once. A guest page that a PT_LOAD segment's  */
+/* file bytes cover completely, at an offset that is page-aligned like its   */
+/* address, is pointed straight at the mapping: nothing is read or copied */
+/* until the guest touches it, and a write copies the page as it does for a  */
+/* sweep image's pages. Only the partial pages at a segment's ends, and the  */
+/* odd segment whose offset isn't aligned like its address, are copied in. */
+/* The rest of p_memsz (.bss) is never touched: unmapped pages read as zero.  */
+/*                                                                                                                                      */
+/* The PC starts at e_entry and $gp at the gp value of the .reginfo, found  */
+/* through its PT_MIPS_REGINFO segment or, failing that, its section.           */
+/***************************************************************/
+
+#define ELFCLASS32       1
+#define ELFDATA2LSB      1
+#define ET_EXEC          2
+#define EM_MIPS          8
+#define PT_LOAD          1
+#define PT_MIPS_REGINFO  0x70000000
+#define SHT_MIPS_REGINFO 0x70000006
+#define PF_X             1
+#define REGINFO_GP       20	/* ri_gp_value, after ri_gprmask and ri_cprmask[4] */
+
+#define EHDR_SIZE 52
+#define PHDR_SIZE 32
+#define SHDR_SIZE 40
+
+typedef struct {
+	uint32_t type, offset, vaddr, filesz, memsz, flags;
+} elf_segment_t;
+
+/* fields are little-endian whatever the host is */
+static uint32_t le16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static uint32_t le32(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+
+/* is [begin, begin + size) inside one memory region? */
+static int in_region(mips_sim_t *sim, uint32_t begin, uint32_t size)
+{
+	int i;
+
+	for (i = 0; i < NUM_MEM_REGION; i++) {
+		if (begin >= sim->MEM_REGIONS[i].begin && begin + (size - 1) <= sim->MEM_REGIONS[i].end) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* point guest page at data in the mapping, shared until written */
+static void map_file_page(mips_sim_t *sim, uint32_t page, uint8_t *data)
+{
+	if (sim->MEM_NUM_FILE == sim->MEM_FILE_CAPACITY) {
+		sim->MEM_FILE_CAPACITY = sim->MEM_FILE_CAPACITY ? 2 * sim->MEM_FILE_CAPACITY : 256;
+		sim->MEM_FILE_PAGES = realloc(sim->MEM_FILE_PAGES, sim->MEM_FILE_CAPACITY * sizeof(uint32_t));
+		sim->MEM_FILE_DATA = realloc(sim->MEM_FILE_DATA, sim->MEM_FILE_CAPACITY * sizeof(uint8_t *));
+		if (sim->MEM_FILE_PAGES == NULL || sim->MEM_FILE_DATA == NULL) {
+			printf("Error: out of memory mapping %s\n", sim->prog_file);
+			exit(-1);
+		}
+	}
+	sim->MEM_FILE_PAGES[sim->MEM_NUM_FILE] = page;
+	sim->MEM_FILE_DATA[sim->MEM_NUM_FILE++] = data;
+	sim->MEM_PAGES[page] = data;
+	/* a page read as zero before may have been decoded */
+	decode_invalidate_page(sim, page << MEM_PAGE_SHIFT);
+}
+
+static void load_segment(mips_sim_t *sim, const elf_segment_t *s)
+{
+	uint32_t first, last, page;
+
+	/* whole pages only exist if the offset and address agree within a page */
+	if (((s->offset ^ s->vaddr) & MEM_PAGE_MASK) == 0 && s->filesz >= MEM_PAGE_SIZE) {
+		first = (s->vaddr + MEM_PAGE_MASK) >> MEM_PAGE_SHIFT;
+		last = (s->vaddr + s->filesz) >> MEM_PAGE_SHIFT;	/* one past the last whole page */
+	} else {
+		first = last = 0;
+	}
+	if (first >= last) {
+		mem_write_block(sim, s->vaddr, sim->PROGRAM_MAP + s->offset, s->filesz);
+		return;
+	}
+	mem_write_block(sim, s->vaddr, sim->PROGRAM_MAP + s->offset, (first << MEM_PAGE_SHIFT) - s->vaddr);
+	for (page = first; page < last; page++) {
+		map_file_page(sim, page, sim->PROGRAM_MAP + s->offset + ((page << MEM_PAGE_SHIFT) - s->vaddr));
+	}
+	mem_write_block(sim, last << MEM_PAGE_SHIFT, sim->PROGRAM_MAP + s->offset + ((last << MEM_PAGE_SHIFT) - s->vaddr),
+			s->vaddr + s->filesz - (last << MEM_PAGE_SHIFT));
+}
+
+static int compare_segments(const void *a, const void *b)
+{
+	uint32_t x = ((const elf_segment_t *)a)->vaddr, y = ((const elf_segment_t *)b)->vaddr;
+	return x < y ? -1 : x > y;
+}
+
+/* the gp value of a .reginfo at offset, if the file holds one there */
+static int reginfo_gp(mips_sim_t *sim, uint32_t offset, uint32_t size, uint32_t *gp)
+{
+	if (size < REGINFO_GP + 4 || offset > sim->PROGRAM_MAP_SIZE - (REGINFO_GP + 4)) {
+		return FALSE;
+	}
+	*gp = le32(sim->PROGRAM_MAP + offset + REGINFO_GP);
+	return TRUE;
+}
+
+/* look for the .reginfo section when no segment points at it */
+static int find_reginfo_section(mips_sim_t *sim, const uint8_t *ehdr, uint32_t *gp)
+{
+	uint32_t shoff = le32(ehdr + 32), shentsize = le16(ehdr + 46), shnum = le16(ehdr + 48), i;
+	const uint8_t *sh;
+
+	if (shoff == 0 || shentsize < SHDR_SIZE || shoff > sim->PROGRAM_MAP_SIZE ||
+	    (uint64_t)shnum * shentsize > sim->PROGRAM_MAP_SIZE - shoff) {
+		return FALSE;
+	}
+	for (i = 0; i < shnum; i++) {
+		sh = sim->PROGRAM_MAP + shoff + i * shentsize;
+		if (le32(sh + 4) == SHT_MIPS_REGINFO) {
+			return reginfo_gp(sim, le32(sh + 16), le32(sh + 20), gp);
+		}
+	}
+	return FALSE;
+}
+
+/***************************************************************/
+/* Load prog_file, a static little-endian MIPS32 ELF executable           */
+/***************************************************************/
+int load_elf(mips_sim_t *sim)
+{
+	const uint8_t *ehdr, *ph;
+	elf_segment_t s, *loads;
+	uint32_t phoff, phentsize, phnum, i, gp = 0, text_start = 0, text_end = 0, segments = 0;
+	int fd, have_gp = FALSE;
+	struct stat st;
+
+	elf_unmap(sim);
+	if ((fd = open(sim->prog_file, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		load_failed(sim, "can't open program file");
+		if (fd >= 0) {
+			close(fd);
+		}
+		return FALSE;
+	}
+	sim->PROGRAM_MAP_SIZE = st.st_size;
+	sim->PROGRAM_MAP = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);	/* the mapping outlives the descriptor */
+	if (sim->PROGRAM_MAP == MAP_FAILED) {
+		load_failed(sim, "can't map program file");
+		sim->PROGRAM_MAP = NULL;
+		return FALSE;
+	}
+
+	ehdr = sim->PROGRAM_MAP;
+	if (sim->PROGRAM_MAP_SIZE < EHDR_SIZE || ehdr[4] != ELFCLASS32 || ehdr[5] != ELFDATA2LSB ||
+	    le16(ehdr + 16) != ET_EXEC || le16(ehdr + 18) != EM_MIPS) {
+		load_failed(sim, "not a static little-endian MIPS32 executable");
+		elf_unmap(sim);
+		return FALSE;
+	}
+	phoff = le32(ehdr + 28);
+	phentsize = le16(ehdr + 42);
+	phnum = le16(ehdr + 44);
+	if (phentsize < PHDR_SIZE || phoff > sim->PROGRAM_MAP_SIZE || (uint64_t)phnum * phentsize > sim->PROGRAM_MAP_SIZE - phoff) {
+		load_failed(sim, "truncated program header table");
+		elf_unmap(sim);
+		return FALSE;
+	}
+
+	loads = malloc(phnum * sizeof(elf_segment_t) + 1);
+	if (loads == NULL) {
+		printf("Error: out of memory loading %s\n", sim->prog_file);
+		exit(-1);
+	}
+	for (i = 0; i < phnum; i++) {
+		ph = sim->PROGRAM_MAP + phoff + i * phentsize;
+		s.type = le32(ph);
+		s.offset = le32(ph + 4);
+		s.vaddr = le32(ph + 8);
+		s.filesz = le32(ph + 16);
+		s.memsz = le32(ph + 20);
+		s.flags = le32(ph + 24);
+
+		if (s.type == PT_MIPS_REGINFO) {
+			have_gp = reginfo_gp(sim, s.offset, s.filesz, &gp);
+		}
+		if (s.type != PT_LOAD || s.memsz == 0) {
+			continue;
+		}
+		if (s.filesz > s.memsz || s.offset > sim->PROGRAM_MAP_SIZE || s.filesz > sim->PROGRAM_MAP_SIZE - s.offset) {
+			load_failed(sim, "segment %u runs past the end of the file", i);
+			free(loads);
+			elf_unmap(sim);
+			return FALSE;
+		}
+		if (!in_region(sim, s.vaddr, s.memsz) || s.vaddr + (s.memsz - 1) < s.vaddr) {
+			load_failed(sim, "segment %u at 0x%08x is outside guest memory", i, s.vaddr);
+			free(loads);
+			elf_unmap(sim);
+			return FALSE;
+		}
+		loads[segments++] = s;
+	}
+
+	/* loaded in address order, MEM_FILE_PAGES comes out sorted for mem_initial_page();
+	 * and with no overlap, no other segment touches a page mapped from the file */
+	qsort(loads, segments, sizeof(elf_segment_t), compare_segments);
+	for (i = 1; i < segments; i++) {
+		if (loads[i].vaddr <= loads[i - 1].vaddr + (loads[i - 1].memsz - 1)) {
+			load_failed(sim, "segments overlap at 0x%08x", loads[i].vaddr);
+			free(loads);
+			elf_unmap(sim);
+			return FALSE;
+		}
+	}
+	for (i = 0; i < segments; i++) {
+		load_segment(sim, &loads[i]);
+		/* the text runs from the first executable segment to the end of the last */
+		if ((loads[i].flags & PF_X) && loads[i].filesz) {
+			if (text_end == 0) {
+				text_start = loads[i].vaddr;
+			}
+			text_end = loads[i].vaddr + loads[i].filesz;
+		}
+	}
+	free(loads);
+	if (!have_gp) {
+		have_gp = find_reginfo_section(sim, ehdr, &gp);
+	}
+
+	sim->PROGRAM_START = text_start;
+	sim->PROGRAM_SIZE = (text_end - text_start) / 4;
+	sim->CURRENT_STATE.PC = le32(ehdr + 24);
+	sim->CURRENT_STATE.REGS[28] = gp;
+	sim->NEXT_STATE = sim->CURRENT_STATE;
+	if (!sim->QUIET) {
+		printf("ELF program loaded: %u segments, %u pages mapped from the file, entry 0x%08x, $gp 0x%08x%s.\n\n",
+		       segments, sim->MEM_NUM_FILE, sim->CURRENT_STATE.PC, gp, have_gp ? "" : " (no .reginfo)");
+	}
+	return TRUE;
+}
+
+/***************************************************************/
+/* Drop the pages still pointing into the program file, and the file */
+/***************************************************************/
+void elf_unmap(mips_sim_t *sim)
+{
+	uint32_t i, page;
+
+	for (i = 0; i < sim->MEM_NUM_FILE; i++) {
+		page = sim->MEM_FILE_PAGES[i];
+		/* a page written since was copied and is freed as a dirty page */
+		if (sim->MEM_PAGES[page] == sim->MEM_FILE_DATA[i]) {
+			sim->MEM_PAGES[page] = NULL;
+			decode_invalidate_page(sim, page << MEM_PAGE_SHIFT);
+		}
+	}
+	sim->MEM_NUM_FILE = 0;
+	if (sim->PROGRAM_MAP) {
+		munmap(sim->PROGRAM_MAP, sim->PROGRAM_MAP_SIZE);
+		sim->PROGRAM_MAP = NULL;
+		sim->PROGRAM_MAP_SIZE = 0;
+	}
+}
@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* x86-64 translation of hot basic blocks                                                                   */
+/*                                                                                                                                      */
+/* Guest registers stay in the simulator's CURRENT_STATE, which the generated  */
+/* code reaches through rbx = sim; loads and stores call mem_read_32/mem_write_32. */
+/* A translated block returns the number of instructions it retired and leaves   */
+/* the PC set. Each simulator has its own code buffer.                                     */
+/***************************************************************/
+
+#if defined(__x86_64__) && !defined(NO_JIT)
+
+#include <sys/mman.h>
+
+#define JIT_BUFFER_SIZE   (4 << 20)
+#define JIT_MAX_INST_SIZE 96	/* bytes of host code one guest instruction can expand to */
+
+/* where the next byte goes; per thread, since simulators may compile concurrently */
+static __thread uint8_t *emit;
+
+#define REG_DISP(r) ((int32_t)(offsetof(mips_sim_t, CURRENT_STATE.REGS) + 4 * (r)))
+#define PC_DISP     ((int32_t)offsetof(mips_sim_t, CURRENT_STATE.PC))
+#define HI_DISP     ((int32_t)offsetof(mips_sim_t, CURRENT_STATE.HI))
+#define LO_DISP     ((int32_t)offsetof(mips_sim_t, CURRENT_STATE.LO))
+#define STALE_DISP  ((int32_t)offsetof(mips_sim_t, BLOCKS_STALE))
+
+static void emit_8(uint8_t byte) { *emit++ = byte; }
+static void emit_32(uint32_t word) { memcpy(emit, &word, 4); emit += 4; }
+static void emit_64(uint64_t word) { memcpy(emit, &word, 8); emit += 8; }
+
+/* <op> r32, [rbx + disp32] (and mov [rbx + disp32], r32 with opcode 0x89) */
+static void emit_rbx_mem(uint8_t opcode, int host_reg, int32_t disp)
+{
+	emit_8(opcode);
+	emit_8(0x80 | (host_reg << 3) | 3); /* mod=10 (disp32), rm=rbx */
+	emit_32(disp);
+}
+
+#define EAX 0
+#define ECX 1
+#define EDX 2
+
+static void load_reg(int host_reg, int guest_reg)  { emit_rbx_mem(0x8B, host_reg, REG_DISP(guest_reg)); }
+static void store_reg(int host_reg, int guest_reg) { emit_rbx_mem(0x89, host_reg, REG_DISP(guest_reg)); }
+
+static void store_imm(int32_t disp, uint32_t value)
+{
+	emit_8(0xC7); emit_8(0x83); emit_32(disp); emit_32(value); /* mov dword [rbx + disp32], imm32 */
+}
+
+static void store_pc_imm(uint32_t pc) { store_imm(PC_DISP, pc); }
+
+static void call_absolute(void *function)
+{
+	emit_8(0x48); emit_8(0xB8); emit_64((uint64_t)(uintptr_t)function); /* mov rax, imm64 */
+	emit_8(0xFF); emit_8(0xD0); /* call rax */
+}
+
+static void emit_return(uint32_t retired)
+{
+	emit_8(0xB8); emit_32(retired); /* mov eax, imm32 */
+	emit_8(0x5B); /* pop rbx */
+	emit_8(0xC3); /* ret */
+}
+
+/* eax = guest effective address rs + imm */
+static void effective_address(const decoded_inst_t *d)
+{
+	load_reg(EAX, d->rs);
+	emit_8(0x05); emit_32(d->imm); /* add eax, imm32 */
+}
+
+/* after a store: if it rewrote text, leave with the PC after it so the rest of the block is re-decoded */
+static void exit_if_stale(uint32_t pc, uint32_t retired)
+{
+	uint8_t *skip;
+
+	emit_rbx_mem(0x83, 7, STALE_DISP); emit_8(0x00); /* cmp dword [rbx + BLOCKS_STALE], 0 */
+	emit_8(0x74); emit_8(0); /* je over the early exit, patched below */
+	skip = emit;
+	store_pc_imm(pc + 4);
+	emit_return(retired);
+	skip[-1] = emit - skip;
+}
+
+/* rs compared against zero picks the PC: ecx = fall-through, edx = target, cmov<cc> ecx, edx */
+static void branch_on_zero(const decoded_inst_t *d, uint32_t fall_through, uint8_t cmov)
+{
+	emit_rbx_mem(0x83, 7, REG_DISP(d->rs)); emit_8(0x00); /* cmp dword [rs], 0 */
+	emit_8(0xB9); emit_32(fall_through); /* mov ecx, imm32 */
+	emit_8(0xBA); emit_32(d->imm); /* mov edx, imm32 */
+	emit_8(0x0F); emit_8(cmov); emit_8(0xCA);
+	emit_rbx_mem(0x89, ECX, PC_DISP);
+}
+
+/***************************************************************/
+/* Can the block be translated at all?                                                                           */
+/***************************************************************/
+static int jit_supported(uint8_t op)
+{
+	switch (op) {
+		case OP_nop: case OP_nop_load: case OP_add: case OP_sub: case OP_and: case OP_or: case OP_xor:
+		case OP_nor: case OP_slt: case OP_sll: case OP_srl: case OP_sra:
+		case OP_mfhi: case OP_mflo: case OP_mthi: case OP_mtlo:
+		case OP_addi: case OP_slti: case OP_andi: case OP_ori: case OP_xori: case OP_lui:
+		case OP_lw: case OP_lb: case OP_lh: case OP_sw: case OP_sb: case OP_sh:
+		case OP_beq: case OP_bne: case OP_blez: case OP_bgtz: case OP_bltz: case OP_bgez:
+		case OP_j: case OP_jal: case OP_jr: case OP_jalr:
+			return TRUE;
+	}
+	/* multiply, divide, syscalls and counter reads stay with the interpreter */
+	return FALSE;
+}
+
+/***************************************************************/
+/* Translate one block; returns FALSE to leave it interpreted                     */
+/***************************************************************/
+int jit_compile(mips_sim_t *sim, block_t *b)
+{
+	const decoded_inst_t *d;
+	uint32_t i, pc, fall_through = b->start + 4 * b->length;
+	uint8_t *code;
+
+	if (sim->JIT_UNAVAILABLE) {
+		return FALSE;
+	}
+	for (i = 0; i < b->length; i++) {
+		if (!jit_supported(b->insts[i].op)) {
+			return FALSE;
+		}
+	}
+
+	if (sim->JIT_BUFFER == NULL) {
+		sim->JIT_BUFFER = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+				       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (sim->JIT_BUFFER == MAP_FAILED) {
+			if (!sim->QUIET) {
+				printf("JIT disabled: can't map executable memory\n");
+			}
+			sim->JIT_BUFFER = NULL;
+			sim->JIT_UNAVAILABLE = TRUE;
+			return FALSE;
+		}
+	}
+	/* a full cache is dropped wholesale, together with the blocks using it, as soon as
+	 * the engine is between blocks */
+	if (sim->JIT_USED + (b->length + 2) * JIT_MAX_INST_SIZE > JIT_BUFFER_SIZE) {
+		sim->BLOCKS_STALE = TRUE;
+		return FALSE;
+	}
+
+	code = emit = sim->JIT_BUFFER + sim->JIT_USED;
+	emit_8(0x53); /* push rbx */
+	emit_8(0x48); emit_8(0x89); emit_8(0xFB); /* mov rbx, rdi */
+
+	for (i = 0, pc = b->start; i < b->length; i++, pc += 4) {
+		d = &b->insts[i];
+		switch (d->op) {
+			case OP_nop:
+			case OP_nop_load:
+				break;
+
+			//R-type ALU: eax = rs <op> rt
+			case OP_add: load_reg(EAX, d->rs); emit_rbx_mem(0x03, EAX, REG_DISP(d->rt)); store_reg(EAX, d->rd); break;
+			case OP_sub: load_reg(EAX, d->rs); emit_rbx_mem(0x2B, EAX, REG_DISP(d->rt)); store_reg(EAX, d->rd); break;
+			case OP_and: load_reg(EAX, d->rs); emit_rbx_mem(0x23, EAX, REG_DISP(d->rt)); store_reg(EAX, d->rd); break;
+			case OP_or:  load_reg(EAX, d->rs); emit_rbx_mem(0x0B, EAX, REG_DISP(d->rt)); store_reg(EAX, d->rd); break;
+			case OP_xor: load_reg(EAX, d->rs); emit_rbx_mem(0x33, EAX, REG_DISP(d->rt)); store_reg(EAX, d->rd); break;
+			case OP_nor:
+				load_reg(EAX, d->rs); emit_rbx_mem(0x0B, EAX, REG_DISP(d->rt));
+				emit_8(0xF7); emit_8(0xD0); /* not eax */
+				store_reg(EAX, d->rd);
+				break;
+			case OP_slt:
+				emit_8(0x31); emit_8(0xC9); /* xor ecx, ecx (before the cmp, it clobbers flags) */
+				load_reg(EAX, d->rs); emit_rbx_mem(0x3B, EAX, REG_DISP(d->rt));
+				emit_8(0x0F); emit_8(0x9C); emit_8(0xC1); /* setl cl */
+				store_reg(ECX, d->rd);
+				break;
+
+			//shifts: shl/shr/sar eax, imm8
+			case OP_sll: load_reg(EAX, d->rt); emit_8(0xC1); emit_8(0xE0); emit_8(d->shamt); store_reg(EAX, d->rd); break;
+			case OP_srl: load_reg(EAX, d->rt); emit_8(0xC1); emit_8(0xE8); emit_8(d->shamt); store_reg(EAX, d->rd); break;
+			case OP_sra: load_reg(EAX, d->rt); emit_8(0xC1); emit_8(0xF8); emit_8(d->shamt); store_reg(EAX, d->rd); break;
+
+			//HI/LO moves
+			case OP_mfhi: emit_rbx_mem(0x8B, EAX, HI_DISP); store_reg(EAX, d->rd); break;
+			case OP_mflo: emit_rbx_mem(0x8B, EAX, LO_DISP); store_reg(EAX, d->rd); break;
+			case OP_mthi: load_reg(EAX, d->rs); emit_rbx_mem(0x89, EAX, HI_DISP); break;
+			case OP_mtlo: load_reg(EAX, d->rs); emit_rbx_mem(0x89, EAX, LO_DISP); break;
+
+			//immediates: eax = rs <op> imm32
+			case OP_addi: load_reg(EAX, d->rs); emit_8(0x05); emit_32(d->imm); store_reg(EAX, d->rt); break;
+			case OP_slti:
+				emit_8(0x31); emit_8(0xC9); /* xor ecx, ecx */
+				load_reg(EAX, d->rs); emit_8(0x3D); emit_32(d->imm); /* cmp eax, imm32 */
+				emit_8(0x0F); emit_8(0x9C); emit_8(0xC1); /* setl cl */
+				store_reg(ECX, d->rt);
+				break;
+			case OP_andi: load_reg(EAX, d->rs); emit_8(0x25); emit_32(d->imm); store_reg(EAX, d->rt); break;
+			case OP_ori:  load_reg(EAX, d->rs); emit_8(0x0D); emit_32(d->imm); store_reg(EAX, d->rt); break;
+			case OP_xori: load_reg(EAX, d->rs); emit_8(0x35); emit_32(d->imm); store_reg(EAX, d->rt); break;
+			case OP_lui:  emit_8(0xB8); emit_32(d->imm); store_reg(EAX, d->rt); break;
+
+			//memory goes through the same accessors as the interpreter
+			case OP_lw:
+			case OP_lb:
+			case OP_lh:
+				effective_address(d);
+				emit_8(0x89); emit_8(0xC6); /* mov esi, eax */
+				emit_8(0x48); emit_8(0x89); emit_8(0xDF); /* mov rdi, rbx */
+				if (d->op == OP_lw) {
+					call_absolute((void *)mem_read_32);
+				} else if (d->op == OP_lb) {
+					call_absolute((void *)mem_read_8);
+					emit_8(0x0F); emit_8(0xBE); emit_8(0xC0); /* movsx eax, al */
+				} else {
+					call_absolute((void *)mem_read_16);
+					emit_8(0x0F); emit_8(0xBF); emit_8(0xC0); /* movsx eax, ax */
+				}
+				store_reg(EAX, d->rt);
+				break;
+			case OP_sw:
+			case OP_sb:
+			case OP_sh:
+				effective_address(d);
+				emit_8(0x89); emit_8(0xC6); /* mov esi, eax */
+				emit_8(0x48); emit_8(0x89); emit_8(0xDF); /* mov rdi, rbx */
+				emit_rbx_mem(0x8B, EDX, REG_DISP(d->rt)); /* the callee truncates edx to its width */
+				call_absolute(d->op == OP_sw ? (void *)mem_write_32 : d->op == OP_sb ? (void *)mem_write_8 : (void *)mem_write_16);
+				exit_if_stale(pc, i + 1);
+				break;
+
+			//control flow: ecx = fall-through, edx = target, pick one with cmov
+			case OP_beq:
+			case OP_bne:
+				load_reg(EAX, d->rs);
+				emit_rbx_mem(0x3B, EAX, REG_DISP(d->rt)); /* cmp eax, [rt] */
+				emit_8(0xB9); emit_32(fall_through); /* mov ecx, imm32 */
+				emit_8(0xBA); emit_32(d->imm); /* mov edx, imm32 */
+				emit_8(0x0F); emit_8(d->op == OP_beq ? 0x44 : 0x45); emit_8(0xCA); /* cmove/cmovne ecx, edx */
+				emit_rbx_mem(0x89, ECX, PC_DISP);
+				emit_return(b->length);
+				break;
+			case OP_blez: branch_on_zero(d, fall_through, 0x4E); emit_return(b->length); break; /* cmovle */
+			case OP_bgtz: branch_on_zero(d, fall_through, 0x4F); emit_return(b->length); break; /* cmovg */
+			case OP_bltz: branch_on_zero(d, fall_through, 0x4C); emit_return(b->length); break; /* cmovl */
+			case OP_bgez: branch_on_zero(d, fall_through, 0x4D); emit_return(b->length); break; /* cmovge */
+			case OP_j:
+				store_pc_imm(d->imm);
+				emit_return(b->length);
+				break;
+			case OP_jal:
+				store_imm(REG_DISP(31), fall_through);
+				store_pc_imm(d->imm);
+				emit_return(b->length);
+				break;
+			case OP_jr:
+			case OP_jalr:
+				load_reg(EAX, d->rs); /* before the link, rs may be rd */
+				if (d->op == OP_jalr) {
+					store_imm(REG_DISP(d->rd), fall_through);
+				}
+				emit_rbx_mem(0x89, EAX, PC_DISP);
+				emit_return(b->length);
+				break;
+		}
+	}
+
+	/* blocks that stop at a page boundary or the length limit fall through */
+	if (OP_CLASS[b->insts[b->length - 1].op] != CLASS_BRANCH && OP_CLASS[b->insts[b->length - 1].op] != CLASS_JUMP) {
+		store_pc_imm(fall_through);
+		emit_return(b->length);
+	}
+
+	sim->JIT_USED = emit - sim->JIT_BUFFER;
+	b->native = (jit_fn_t)code;
+	return TRUE;
+}
+
+/***************************************************************/
+/* Forget all translations (the blocks using them are being flushed)        */
+/***************************************************************/
+void jit_flush(mips_sim_t *sim)
+{
+	sim->JIT_USED = 0;
+}
+
+/***************************************************************/
+/* Give the code buffer back when the simulator is destroyed             */
+/***************************************************************/
+void jit_free(mips_sim_t *sim)
+{
+	if (sim->JIT_BUFFER) {
+		munmap(sim->JIT_BUFFER, JIT_BUFFER_SIZE);
+		sim->JIT_BUFFER = NULL;
+		sim->JIT_USED = 0;
+	}
+}
+
+#else
+
+int jit_compile(mips_sim_t *sim, block_t *b)
+{
+	return FALSE;
+}
+
+void jit_flush(mips_sim_t *sim)
+{
+}
+
+void jit_free(mips_sim_t *sim)
+{
+}
+
+#endif
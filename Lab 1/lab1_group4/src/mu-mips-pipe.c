@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* Five-stage pipeline timing: IF, ID, EX, MEM, WB                          */
+/*                                                                                                                                      */
+/* Instructions still execute one at a time through the functional core's     */
+/* handlers, decode cache and memory. Alongside, each one is given the cycle   */
+/* it enters every stage, from the previous instruction's cycles and the        */
+/* cycle each register it reads becomes available:                                    */
+/*	IF  = max(IF' + 1, ID', redirect)                                                        */
+/*	ID  = max(IF + 1, EX')                                                                         */
+/*	EX  = max(ID + 1, MEM', operands ready)                                              */
+/*	MEM = max(EX + 1, WB')                                                                         */
+/*	WB  = MEM + 1                                                                                    */
+/* (' is the previous instruction). A stage holds one instruction, so a stall  */
+/* holds everything behind it, the same cycles a latch-by-latch model gives   */
+/* for an in-order single-issue pipeline, at the cost of a few compares.         */
+/*                                                                                                                                      */
+/* Forwarding hands an ALU result from EX/MEM and a loaded value from MEM/WB  */
+/* to the next EX; without it a value is read in ID in the cycle it is written */
+/* back. Branches and register jumps resolve in EX, j and jal in ID; fetch     */
+/* continues at PC + 4, or where the first -bp predictor says, and is            */
+/* redirected when that was wrong.                                                              */
+/*                                                                                                                                      */
+/* Sampling (-sample <skip> <window>) alternates the functional engine for     */
+/* skip instructions with the pipeline for window instructions. Both work on  */
+/* the same CURRENT_STATE and memory, so switching costs nothing, and the     */
+/* statistics of the timed windows are scaled up to the whole run.               */
+/***************************************************************/
+
+/* registers an operation reads, and the one it writes; decode already turned writes to $0 into nops */
+enum { USE_RS = 1, USE_RT = 2, USE_HI = 4, USE_LO = 8, USE_V0 = 16, USE_A0 = 32 };
+enum { DEF_NONE, DEF_RD, DEF_RT, DEF_RA, DEF_HI, DEF_LO, DEF_HILO, DEF_V0 };
+
+typedef struct {
+	uint8_t uses;	/* USE_* */
+	uint8_t def;	/* DEF_* */
+} pipe_operands_t;
+
+static const pipe_operands_t OP_OPERANDS[NUM_OPS] = {
+	[OP_nop]   = { 0, DEF_NONE }, [OP_nop_load] = { USE_RS, DEF_NONE },
+	[OP_add]   = { USE_RS | USE_RT, DEF_RD }, [OP_sub] = { USE_RS | USE_RT, DEF_RD },
+	[OP_and]   = { USE_RS | USE_RT, DEF_RD }, [OP_or]  = { USE_RS | USE_RT, DEF_RD },
+	[OP_xor]   = { USE_RS | USE_RT, DEF_RD }, [OP_nor] = { USE_RS | USE_RT, DEF_RD },
+	[OP_slt]   = { USE_RS | USE_RT, DEF_RD },
+	[OP_sll]   = { USE_RT, DEF_RD }, [OP_srl] = { USE_RT, DEF_RD }, [OP_sra] = { USE_RT, DEF_RD },
+	[OP_mult]  = { USE_RS | USE_RT, DEF_HILO }, [OP_multu] = { USE_RS | USE_RT, DEF_HILO },
+	[OP_div]   = { USE_RS | USE_RT, DEF_HILO }, [OP_divu]  = { USE_RS | USE_RT, DEF_HILO },
+	[OP_mfhi]  = { USE_HI, DEF_RD }, [OP_mflo] = { USE_LO, DEF_RD },
+	[OP_mthi]  = { USE_RS, DEF_HI }, [OP_mtlo] = { USE_RS, DEF_LO },
+	[OP_addi]  = { USE_RS, DEF_RT }, [OP_slti] = { USE_RS, DEF_RT }, [OP_andi] = { USE_RS, DEF_RT },
+	[OP_ori]   = { USE_RS, DEF_RT }, [OP_xori] = { USE_RS, DEF_RT }, [OP_lui]  = { 0, DEF_RT },
+	[OP_lw]    = { USE_RS, DEF_RT }, [OP_lb] = { USE_RS, DEF_RT }, [OP_lh] = { USE_RS, DEF_RT },
+	[OP_sw]    = { USE_RS | USE_RT, DEF_NONE }, [OP_sb] = { USE_RS | USE_RT, DEF_NONE },
+	[OP_sh]    = { USE_RS | USE_RT, DEF_NONE },
+	[OP_beq]   = { USE_RS | USE_RT, DEF_NONE }, [OP_bne]  = { USE_RS | USE_RT, DEF_NONE },
+	[OP_blez]  = { USE_RS, DEF_NONE }, [OP_bgtz] = { USE_RS, DEF_NONE },
+	[OP_bltz]  = { USE_RS, DEF_NONE }, [OP_bgez] = { USE_RS, DEF_NONE },
+	[OP_j]     = { 0, DEF_NONE }, [OP_jal] = { 0, DEF_RA },
+	[OP_jr]    = { USE_RS, DEF_NONE }, [OP_jalr] = { USE_RS, DEF_RD },
+	[OP_syscall] = { USE_V0 | USE_A0, DEF_V0 },	/* read_int and sbrk return in $v0 */
+	[OP_mfc0]    = { 0, DEF_RT },
+};
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/* latest cycle a source register lets the instruction enter EX; sets *from_load if a load decided it */
+static uint64_t operand_ready(const pipe_state_t *p, int reg, uint64_t ready, int *from_load)
+{
+	if (p->READY[reg] > ready) {
+		*from_load = p->FROM_LOAD[reg];
+		return p->READY[reg];
+	}
+	return ready;
+}
+
+/***************************************************************/
+/* Pipeline engine: the functional core, timed stage by stage        */
+/***************************************************************/
+uint32_t run_pipeline(mips_sim_t *sim, uint32_t max_instructions)
+{
+	CPU_State *state = &sim->CURRENT_STATE;
+	pipe_state_t *p = &sim->PIPE;
+	const decoded_inst_t *d;
+	pipe_operands_t operands;
+	uint64_t stage[PIPE_STAGES], structural, ready;
+	uint32_t remaining = max_instructions, pc;
+	uint8_t rs, rt, rd;
+	int op, from_load, mispredicted;
+
+	while (remaining && sim->RUN_FLAG) {
+		remaining--;
+		pc = state->PC;
+		d = decode_fetch(sim, pc);
+		/* a store may rewrite its own record, so take the fields before running it */
+		op = d->op;
+		rs = d->rs;
+		rt = d->rt;
+		rd = d->rd;
+		operands = OP_OPERANDS[op];
+
+		/* IF: waits for the previous instruction to leave IF and for any redirect */
+		structural = MAX(p->STAGE[PIPE_IF] + 1, p->STAGE[PIPE_ID]);
+		stage[PIPE_IF] = MAX(structural, p->REDIRECT);
+		stage[PIPE_ID] = MAX(stage[PIPE_IF] + 1, p->STAGE[PIPE_EX]);
+
+		/* a redirect only costs what it adds on top of a stall already holding ID */
+		p->CONTROL_STALLS += stage[PIPE_ID] - MAX(structural + 1, p->STAGE[PIPE_EX]);
+
+		/* EX: hazard detection, each source checked against the cycle it can be forwarded or read */
+		structural = MAX(stage[PIPE_ID] + 1, p->STAGE[PIPE_MEM]);
+		ready = 0;
+		from_load = FALSE;
+		if (operands.uses & USE_RS) ready = operand_ready(p, rs, ready, &from_load);
+		if (operands.uses & USE_RT) ready = operand_ready(p, rt, ready, &from_load);
+		if (operands.uses & USE_HI) ready = operand_ready(p, PIPE_HI, ready, &from_load);
+		if (operands.uses & USE_LO) ready = operand_ready(p, PIPE_LO, ready, &from_load);
+		if (operands.uses & USE_V0) ready = operand_ready(p, 2, ready, &from_load);
+		if (operands.uses & USE_A0) ready = operand_ready(p, 4, ready, &from_load);
+		stage[PIPE_EX] = MAX(structural, ready);
+		if (stage[PIPE_EX] > structural) {
+			p->DATA_STALLS += stage[PIPE_EX] - structural;
+			if (from_load) {
+				p->LOAD_USE_STALLS += stage[PIPE_EX] - structural;
+			}
+		}
+
+		stage[PIPE_MEM] = MAX(stage[PIPE_EX] + 1, p->STAGE[PIPE_WB]);
+		stage[PIPE_WB] = stage[PIPE_MEM] + 1;
+		memcpy(p->STAGE, stage, sizeof(stage));
+
+		/* results: forwarded from the end of EX (MEM for loads), else read in ID during WB */
+		if (sim->PIPE_FORWARDING) {
+			ready = OP_CLASS[op] == CLASS_LOAD ? stage[PIPE_MEM] + 1 : stage[PIPE_EX] + 1;
+		} else {
+			ready = stage[PIPE_WB] + 1;
+		}
+		switch (operands.def) {
+			case DEF_RD:   p->READY[rd] = ready; p->FROM_LOAD[rd] = FALSE; break;
+			case DEF_RT:   p->READY[rt] = ready; p->FROM_LOAD[rt] = OP_CLASS[op] == CLASS_LOAD; break;
+			case DEF_RA:   p->READY[31] = ready; p->FROM_LOAD[31] = FALSE; break;
+			case DEF_HI:   p->READY[PIPE_HI] = ready; break;
+			case DEF_LO:   p->READY[PIPE_LO] = ready; break;
+			case DEF_HILO: p->READY[PIPE_HI] = p->READY[PIPE_LO] = ready; break;
+			case DEF_V0:   p->READY[2] = ready; p->FROM_LOAD[2] = FALSE; break;
+		}
+
+		state->PC = pc + 4;
+		d->handler(sim, d, state, state);
+		/* counted after it runs, so an MFC0 reads the instructions before it */
+		sim->INSTRUCTION_COUNT++;
+		perf_count(&sim->PERF, op, pc + 4, state->PC);
+		if (sim->PROFILE) {
+			profile_count(sim, pc, 1);
+		}
+
+		/* fetch went on at pc + 4, or where the first predictor said; anything else
+		 * squashes what was fetched meanwhile */
+		if (sim->NUM_BPRED && (OP_CLASS[op] == CLASS_BRANCH || OP_CLASS[op] == CLASS_JUMP)) {
+			mispredicted = !bpred_resolve(sim, d, pc, state->PC);
+		} else {
+			mispredicted = state->PC != pc + 4;
+		}
+		if (sim->CALLGRAPH && OP_CLASS[op] == CLASS_JUMP) {
+			callgraph_jump(sim, d, pc, state->PC, sim->INSTRUCTION_COUNT);
+		}
+		if (mispredicted) {
+			p->REDIRECT = (op == OP_j || op == OP_jal ? stage[PIPE_ID] : stage[PIPE_EX]) + 1;
+			p->FLUSHES++;
+		}
+		p->INSTRUCTIONS++;
+	}
+
+	sim->NEXT_STATE = sim->CURRENT_STATE;
+	return max_instructions - remaining;
+}
+
+/***************************************************************/
+/* Start a timed window as if the pipeline were already full           */
+/***************************************************************/
+static void pipe_start_window(pipe_state_t *p)
+{
+	uint64_t base = p->STAGE[PIPE_WB];
+	int s;
+
+	/* the previous instruction is placed one cycle apart in each stage, finishing WB
+	 * PIPE_STAGES - 1 cycles later than the last timed one did; that gap is not
+	 * pipeline time, and nothing recorded before it can stall the next instruction */
+	for (s = 0; s < PIPE_STAGES; s++) {
+		p->STAGE[s] = base + s;
+	}
+	p->UNTIMED_CYCLES += PIPE_STAGES - 1;
+	p->WINDOWS++;
+}
+
+/***************************************************************/
+/* Sampling: fast-forward on ENGINE, time a window, repeat          */
+/***************************************************************/
+uint32_t run_sampled(mips_sim_t *sim, uint32_t max_instructions)
+{
+	pipe_state_t *p = &sim->PIPE;
+	uint32_t period = sim->SAMPLE_SKIP + sim->SAMPLE_WINDOW;
+	uint32_t retired = 0, chunk, n;
+
+	while (retired < max_instructions && sim->RUN_FLAG) {
+		/* SAMPLE_POS survives between calls, so run <n> may stop anywhere in the period */
+		if (p->SAMPLE_POS < sim->SAMPLE_SKIP) {
+			chunk = sim->SAMPLE_SKIP - p->SAMPLE_POS;
+		} else {
+			if (p->SAMPLE_POS == sim->SAMPLE_SKIP) {
+				pipe_start_window(p);
+			}
+			chunk = period - p->SAMPLE_POS;
+		}
+		if (chunk > max_instructions - retired) {
+			chunk = max_instructions - retired;
+		}
+
+		n = p->SAMPLE_POS < sim->SAMPLE_SKIP ? run_engine(sim, chunk) : run_pipeline(sim, chunk);
+		retired += n;
+		p->SAMPLE_POS += n;
+		if (p->SAMPLE_POS == period) {
+			p->SAMPLE_POS = 0;
+		}
+	}
+	return retired;
+}
+
+/***************************************************************/
+/* Cycles, CPI and where the stalls came from                               */
+/***************************************************************/
+void pipe_report(mips_sim_t *sim, FILE *out)
+{
+	const pipe_state_t *p = &sim->PIPE;
+	/* the last instruction has left WB once its WB cycle is over */
+	uint64_t cycles = p->STAGE[PIPE_WB] - p->UNTIMED_CYCLES;
+	double scale;
+
+	if (sim->SAMPLE_WINDOW) {
+		/* every instruction is assumed to behave like the timed ones on average */
+		scale = p->INSTRUCTIONS ? (double)sim->INSTRUCTION_COUNT / p->INSTRUCTIONS : 0.0;
+		fprintf(out, "Sampled pipeline (%s forwarding): %llu of %llu instructions timed in %llu windows, CPI %.3f\n",
+			sim->PIPE_FORWARDING ? "with" : "no", (unsigned long long)p->INSTRUCTIONS, (unsigned long long)sim->INSTRUCTION_COUNT,
+			(unsigned long long)p->WINDOWS, p->INSTRUCTIONS ? (double)cycles / p->INSTRUCTIONS : 0.0);
+		fprintf(out, "\testimated: %.0f cycles, stalls %.0f data (%.0f load-use), %.0f control over %.0f redirects\n",
+			cycles * scale, p->DATA_STALLS * scale, p->LOAD_USE_STALLS * scale, p->CONTROL_STALLS * scale,
+			p->FLUSHES * scale);
+		return;
+	}
+
+	fprintf(out, "Pipeline (%s forwarding): %llu cycles, %llu instructions, CPI %.3f\n",
+		sim->PIPE_FORWARDING ? "with" : "no", (unsigned long long)cycles, (unsigned long long)p->INSTRUCTIONS,
+		p->INSTRUCTIONS ? (double)cycles / p->INSTRUCTIONS : 0.0);
+	fprintf(out, "\tstalls: %llu data (%llu load-use), %llu control over %llu redirects\n",
+		(unsigned long long)p->DATA_STALLS, (unsigned long long)p->LOAD_USE_STALLS,
+		(unsigned long long)p->CONTROL_STALLS, (unsigned long long)p->FLUSHES);
+}
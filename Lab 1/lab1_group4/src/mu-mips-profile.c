@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* Execution profile                                                                                                      */
+/*                                                                                                                                      */
+/* PROFILE_COUNTS holds one counter per text word, paged like DECODE_CACHE.  */
+/* The interpreter, threaded and pipeline engines bump the counter of every  */
+/* instruction they run. The block and JIT engines count whole executions of */
+/* a block in the block instead, and fold that into the words when the blocks */
+/* are flushed or a profile is printed.                                                    */
+/*                                                                                                                                      */
+/* Hot blocks are rebuilt from the counters as basic blocks: a block starts    */
+/* at a branch or jump target, or after a branch, jump or syscall. Indirect   */
+/* jump targets aren't known, so a change of count also starts a block.       */
+/***************************************************************/
+
+#define PROFILE_TOP_PCS    20
+#define PROFILE_TOP_BLOCKS 5
+
+typedef struct {
+	uint32_t pc;		/* first instruction */
+	uint32_t length;	/* instructions */
+	uint64_t count;		/* executions of each of them */
+} profile_entry_t;
+
+/***************************************************************/
+/* Add n executions to every word of the first length of block b      */
+/***************************************************************/
+void profile_count_block(mips_sim_t *sim, const block_t *b, uint32_t length, uint64_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i < length; i++) {
+		profile_count(sim, b->start + 4 * i, n);
+	}
+}
+
+/***************************************************************/
+/* Move every block's pending count into the per-word counters          */
+/***************************************************************/
+void profile_fold_blocks(mips_sim_t *sim)
+{
+	block_t *b;
+
+	for (b = sim->BLOCK_LIST; b != NULL; b = b->next_allocated) {
+		if (b->profile_count) {
+			profile_count_block(sim, b, b->length, b->profile_count);
+			b->profile_count = 0;
+		}
+	}
+}
+
+/***************************************************************/
+/* Zero every counter, keeping the pages for the next run                */
+/***************************************************************/
+void profile_clear(mips_sim_t *sim)
+{
+	block_t *b;
+	uint32_t i;
+
+	for (b = sim->BLOCK_LIST; b != NULL; b = b->next_allocated) {
+		b->profile_count = 0;
+	}
+	for (i = 0; i < MEM_TEXT_PAGES; i++) {
+		if (sim->PROFILE_COUNTS[i]) {
+			memset(sim->PROFILE_COUNTS[i], 0, DECODE_SLOTS * sizeof(uint64_t));
+		}
+	}
+	sim->PROFILE_OUTSIDE = 0;
+}
+
+static int compare_pcs(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/***************************************************************/
+/* Sorted targets of the decoded branches and direct jumps                 */
+/***************************************************************/
+static uint32_t *branch_targets(mips_sim_t *sim, uint32_t *num_targets)
+{
+	uint32_t *targets = NULL, capacity = 0, page, slot;
+	const decoded_inst_t *d;
+
+	*num_targets = 0;
+	for (page = 0; page < MEM_TEXT_PAGES; page++) {
+		if (sim->DECODE_CACHE[page] == NULL) {
+			continue;
+		}
+		for (slot = 0; slot < DECODE_SLOTS; slot++) {
+			d = &sim->DECODE_CACHE[page][slot];
+			if (d->handler == NULL || (OP_CLASS[d->op] != CLASS_BRANCH && d->op != OP_j && d->op != OP_jal)) {
+				continue;
+			}
+			if (*num_targets == capacity) {
+				capacity = capacity ? 2 * capacity : 256;
+				targets = realloc(targets, capacity * sizeof(uint32_t));
+				if (targets == NULL) {
+					printf("Error: out of memory building the profile\n");
+					exit(-1);
+				}
+			}
+			targets[(*num_targets)++] = d->imm;
+		}
+	}
+	qsort(targets, *num_targets, sizeof(uint32_t), compare_pcs);
+	return targets;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	const profile_entry_t *x = a, *y = b;
+	uint64_t wx = x->count * x->length, wy = y->count * y->length;
+
+	/* heaviest first; equal weights stay in address order */
+	if (wx != wy) {
+		return wx < wy ? 1 : -1;
+	}
+	return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+/***************************************************************/
+/* Hottest instructions and blocks, with their disassembly               */
+/***************************************************************/
+void profile_report(mips_sim_t *sim)
+{
+	profile_entry_t *pcs = NULL, *blocks = NULL;
+	uint32_t num_pcs = 0, num_blocks = 0, capacity = 0;
+	uint32_t page, slot, pc, i, j, num_targets, next_target = 0;
+	uint32_t *targets;
+	uint64_t count, total = sim->PROFILE_OUTSIDE;
+	const decoded_inst_t *d;
+	int extend = FALSE;	/* the previous word can carry on into this one */
+
+	profile_fold_blocks(sim);
+	targets = branch_targets(sim, &num_targets);
+
+	/* one pass over the counted words in address order gives both lists */
+	for (page = 0; page < MEM_TEXT_PAGES; page++) {
+		if (sim->PROFILE_COUNTS[page] == NULL) {
+			extend = FALSE;
+			continue;
+		}
+		for (slot = 0; slot < DECODE_SLOTS; slot++) {
+			count = sim->PROFILE_COUNTS[page][slot];
+			if (count == 0) {
+				extend = FALSE;
+				continue;
+			}
+			if (num_pcs == capacity) {
+				capacity = capacity ? 2 * capacity : 1024;
+				pcs = realloc(pcs, capacity * sizeof(profile_entry_t));
+				blocks = realloc(blocks, capacity * sizeof(profile_entry_t));
+				if (pcs == NULL || blocks == NULL) {
+					printf("Error: out of memory building the profile\n");
+					exit(-1);
+				}
+			}
+			pc = MEM_TEXT_BEGIN + (page << MEM_PAGE_SHIFT) + 4 * slot;
+			pcs[num_pcs].pc = pc;
+			pcs[num_pcs].length = 1;
+			pcs[num_pcs].count = count;
+			num_pcs++;
+			total += count;
+
+			/* a word that ran as often as the one before it continues its block, unless
+			 * something branches to it */
+			while (next_target < num_targets && targets[next_target] < pc) {
+				next_target++;
+			}
+			if (next_target < num_targets && targets[next_target] == pc) {
+				extend = FALSE;
+			}
+			if (extend && blocks[num_blocks - 1].count == count) {
+				blocks[num_blocks - 1].length++;
+			} else {
+				blocks[num_blocks].pc = pc;
+				blocks[num_blocks].length = 1;
+				blocks[num_blocks].count = count;
+				num_blocks++;
+			}
+			/* after a branch, jump or syscall the next word starts a new block however often it ran */
+			d = sim->DECODE_CACHE[page] ? &sim->DECODE_CACHE[page][slot] : NULL;
+			extend = !(d && d->handler && OP_CLASS[d->op] >= CLASS_BRANCH);
+		}
+	}
+
+	printf("Profile: %llu instructions executed", (unsigned long long)total);
+	if (sim->PROFILE_OUTSIDE) {
+		printf(", %llu outside the text segment", (unsigned long long)sim->PROFILE_OUTSIDE);
+	}
+	printf("\n\n");
+	free(targets);
+	if (num_pcs == 0) {
+		return;
+	}
+
+	qsort(pcs, num_pcs, sizeof(profile_entry_t), compare_entries);
+	printf("Hottest instructions:\n");
+	printf("\t[Address]\t    Count\t  %%\tInstruction\n");
+	for (i = 0; i < num_pcs && i < PROFILE_TOP_PCS; i++) {
+		printf("\t[0x%08x]\t%9llu\t%5.1f\t", pcs[i].pc, (unsigned long long)pcs[i].count, 100.0 * pcs[i].count / total);
+		print_instruction(sim, pcs[i].pc);
+	}
+
+	qsort(blocks, num_blocks, sizeof(profile_entry_t), compare_entries);
+	printf("\nHottest blocks:\n");
+	for (i = 0; i < num_blocks && i < PROFILE_TOP_BLOCKS; i++) {
+		printf("\t[0x%08x..0x%08x] %llu times x %u instructions (%.1f%%)\n", blocks[i].pc,
+		       blocks[i].pc + 4 * (blocks[i].length - 1), (unsigned long long)blocks[i].count, blocks[i].length,
+		       100.0 * blocks[i].count * blocks[i].length / total);
+		for (j = 0; j < blocks[i].length; j++) {
+			printf("\t\t[0x%08x]\t", blocks[i].pc + 4 * j);
+			print_instruction(sim, blocks[i].pc + 4 * j);
+		}
+	}
+	printf("\n");
+	free(pcs);
+	free(blocks);
+}
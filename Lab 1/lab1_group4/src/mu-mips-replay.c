@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* Record and replay                                                                                                      */
+/*                                                                                                                                      */
+/* Given the program, a run depends only on the commands typed at the front   */
+/* end and on values from outside the guest that syscalls hand it. -record     */
+/* logs both as they happen; -replay feeds them back without the prompt, so a */
+/* long session comes back exactly, and at full speed.                              */
+/*                                                                                                                                      */
+/* The log is binary:                                                                                                  */
+/*	"MUMIPSRR", version byte                                                                              */
+/*	program path (length, then bytes), program size in words, text hash       */
+/*	then one record per event: a CMD_* byte and that command's arguments,     */
+/*	or LOG_VALUE and the value a syscall returned                                        */
+/* Every number is an unsigned LEB128 varint, so most take a byte or two.      */
+/***************************************************************/
+
+#define LOG_MAGIC   "MUMIPSRR"
+#define LOG_VERSION 1
+#define LOG_VALUE   0xFF
+
+/* arguments each command carries */
+static const uint8_t CMD_ARGS[NUM_CMDS] = {
+	[CMD_RUN] = 1, [CMD_INPUT] = 2, [CMD_HIGH] = 1, [CMD_LOW] = 1, [CMD_MDUMP] = 2, [CMD_RSTEP] = 1,
+};
+
+static void put_varint(FILE *f, uint32_t value)
+{
+	while (value >= 0x80) {
+		fputc((value & 0x7F) | 0x80, f);
+		value >>= 7;
+	}
+	fputc(value, f);
+}
+
+static int get_varint(FILE *f, uint32_t *value)
+{
+	int byte, shift;
+
+	*value = 0;
+	for (shift = 0; shift < 35; shift += 7) {
+		if ((byte = fgetc(f)) == EOF) {
+			return FALSE;
+		}
+		*value |= (uint32_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* FNV-1a over where the text was loaded and what it holds, to catch a replay against
+ * a different program */
+static uint32_t text_hash(mips_sim_t *sim)
+{
+	uint32_t hash = (2166136261u ^ sim->PROGRAM_START) * 16777619u, i;
+
+	for (i = 0; i < sim->PROGRAM_SIZE; i++) {
+		hash = (hash ^ mem_read_32(sim, sim->PROGRAM_START + 4 * i)) * 16777619u;
+	}
+	return hash;
+}
+
+/***************************************************************/
+/* Start a log for the program just loaded                                         */
+/***************************************************************/
+int record_open(mips_sim_t *sim, const char *file)
+{
+	FILE *f = fopen(file, "wb");
+	size_t length = strlen(sim->prog_file);
+
+	if (f == NULL) {
+		printf("Error: Can't write the record log %s\n", file);
+		return FALSE;
+	}
+	fwrite(LOG_MAGIC, 1, strlen(LOG_MAGIC), f);
+	fputc(LOG_VERSION, f);
+	put_varint(f, length);
+	fwrite(sim->prog_file, 1, length, f);
+	put_varint(f, sim->PROGRAM_SIZE);
+	put_varint(f, text_hash(sim));
+	sim->RECORD_FILE = f;
+	return TRUE;
+}
+
+void record_command(mips_sim_t *sim, const command_t *c)
+{
+	int i;
+
+	fputc(c->kind, sim->RECORD_FILE);
+	for (i = 0; i < CMD_ARGS[c->kind]; i++) {
+		put_varint(sim->RECORD_FILE, c->arg[i]);
+	}
+}
+
+void record_close(mips_sim_t *sim)
+{
+	if (sim->RECORD_FILE) {
+		fclose(sim->RECORD_FILE);
+		sim->RECORD_FILE = NULL;
+	}
+}
+
+/***************************************************************/
+/* A value from outside the guest: fetched and logged when            */
+/* recording, taken from the log when replaying, just fetched         */
+/* otherwise                                                                                              */
+/***************************************************************/
+uint32_t replay_value(mips_sim_t *sim, uint32_t (*fetch)(mips_sim_t *sim))
+{
+	uint32_t value;
+
+	/* run again after rstep, the program gets what it got the first time, from memory */
+	if (sim->REVERSE && reverse_replayed_value(sim, &value)) {
+		return value;
+	}
+	if (sim->REPLAY_FILE) {
+		if (fgetc(sim->REPLAY_FILE) != LOG_VALUE || !get_varint(sim->REPLAY_FILE, &value)) {
+			printf("Error: the replay log has no value where the program asked for one\n");
+			exit(1);
+		}
+	} else {
+		value = fetch(sim);
+		if (sim->RECORD_FILE) {
+			fputc(LOG_VALUE, sim->RECORD_FILE);
+			put_varint(sim->RECORD_FILE, value);
+		}
+	}
+	if (sim->REVERSE) {
+		reverse_keep_value(sim, value);
+	}
+	return value;
+}
+
+/***************************************************************/
+/* Load the logged program, or program if given, and run every     */
+/* command in the log; FALSE if the log can't be replayed             */
+/***************************************************************/
+int replay_run(mips_sim_t *sim, const char *file, const char *program)
+{
+	FILE *f = fopen(file, "rb");
+	char magic[sizeof(LOG_MAGIC) - 1];
+	uint32_t length, size, hash;
+	command_t c;
+	int kind, i;
+
+	if (f == NULL) {
+		printf("Error: Can't open the replay log %s\n", file);
+		return FALSE;
+	}
+	if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, LOG_MAGIC, sizeof(magic)) != 0 ||
+	    fgetc(f) != LOG_VERSION || !get_varint(f, &length) || length >= sizeof(sim->prog_file) ||
+	    fread(sim->prog_file, 1, length, f) != length || !get_varint(f, &size) || !get_varint(f, &hash)) {
+		printf("Error: %s is not a record log\n", file);
+		fclose(f);
+		return FALSE;
+	}
+	sim->prog_file[length] = '\0';
+	if (program) {
+		snprintf(sim->prog_file, sizeof(sim->prog_file), "%s", program);
+	}
+
+	sim->QUIET = TRUE;
+	if (!load_program(sim)) {
+		printf("Error: %s: %s\n", sim->prog_file, sim->LOAD_ERROR);
+		fclose(f);
+		return FALSE;
+	}
+	if (sim->PROGRAM_SIZE != size || text_hash(sim) != hash) {
+		printf("Error: %s is not the program %s was recorded with\n", sim->prog_file, file);
+		fclose(f);
+		return FALSE;
+	}
+	if (sim->CALLGRAPH) {
+		callgraph_reset(sim);	/* the root is the entry point just loaded */
+	}
+
+	sim->REPLAY_FILE = f;
+	while ((kind = fgetc(f)) != EOF) {
+		if (kind >= NUM_CMDS) {
+			printf("Error: the replay log has a value where a command should be\n");
+			break;
+		}
+		c.kind = kind;
+		for (i = 0; i < CMD_ARGS[kind]; i++) {
+			if (!get_varint(f, &c.arg[i])) {
+				printf("Error: the replay log ends in the middle of a command\n");
+				break;
+			}
+		}
+		if (i < CMD_ARGS[kind]) {
+			break;
+		}
+		execute_command(sim, &c);
+	}
+	sim->REPLAY_FILE = NULL;
+	fclose(f);
+	return kind == EOF;
+}
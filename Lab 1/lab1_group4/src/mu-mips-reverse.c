@@ -0,0 +1,413 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* Reverse execution                                                                                                     */
+/*                                                                                                                                      */
+/* With -reverse <K>, run_engine() stops every K instructions for a checkpoint:  */
+/* the CPU state and a copy of each page written since the checkpoint before. */
+/* The first checkpoint of a run copies every page the program owns. After a */
+/* checkpoint its pages are write-protected by clearing MEM_WRITE_PAGES, so   */
+/* the next store to one goes through mem_map_page(), which hands the page    */
+/* number to reverse_page_written() and makes it writable again.                  */
+/*                                                                                                                                      */
+/* Going back to instruction T restores the newest checkpoint at or before T   */
+/* and runs forward to T. Only pages written since that checkpoint change: each */
+/* gets its newest copy from a checkpoint no later than it.                         */
+/*                                                                                                                                      */
+/* Memory stays bounded however long the run: past REVERSE_MAX_CHECKPOINTS,  */
+/* or REVERSE_MAX_PAGES stored pages, a checkpoint is merged into the next one */
+/* (its pages that one doesn't have move over). The one merged is where the   */
+/* gap it leaves is smallest next to how long ago it was, so checkpoints thin */
+/* out with age and stepping back a little stays cheap.                                */
+/*                                                                                                                                      */
+/* The counters MFC0 reads are rewound with the state; pipeline, predictor */
+/* and profile statistics, host time and guest output already printed are not. */
+/***************************************************************/
+
+#define REVERSE_MAX_CHECKPOINTS 64
+#define REVERSE_MAX_PAGES       16384	/* 64 MB of page copies */
+
+typedef struct {
+	uint64_t count;		/* INSTRUCTION_COUNT when taken */
+	perf_counters_t perf;	/* the guest reads these through MFC0, so they rewind too */
+	CPU_State state;
+	int run_flag;
+	uint32_t heap_break;	/* sbrk's, with the exit2 code */
+	int exit_code;
+	uint32_t values;	/* outside values the program had taken by then */
+	uint32_t num_pages;
+	uint32_t *pages;	/* sorted guest page numbers */
+	uint8_t **data;		/* their contents when the checkpoint was taken */
+} checkpoint_t;
+
+struct reverse_struct {
+	uint32_t interval;
+	checkpoint_t checkpoints[REVERSE_MAX_CHECKPOINTS + 1];
+	int num_checkpoints;
+	uint64_t next_due;	/* run_engine() stops here for the next checkpoint */
+	uint64_t stored_pages;
+
+	/* pages written since the newest checkpoint, i.e. the writable ones */
+	uint32_t *written;
+	uint32_t num_written, written_capacity;
+
+	/* values syscalls took from outside, kept so going back and forth sees them again */
+	uint32_t *values;
+	uint32_t num_values, values_capacity;
+	uint32_t value_cursor;	/* next one to hand out; below num_values only while re-executing */
+};
+
+static void *reverse_grow(void *array, uint32_t *capacity, size_t size)
+{
+	*capacity = *capacity ? 2 * *capacity : 256;
+	array = realloc(array, *capacity * size);
+	if (array == NULL) {
+		printf("Error: out of memory growing the reverse execution history\n");
+		exit(-1);
+	}
+	return array;
+}
+
+static int compare_pages(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void free_checkpoint(reverse_t *r, checkpoint_t *cp)
+{
+	uint32_t i;
+
+	for (i = 0; i < cp->num_pages; i++) {
+		free(cp->data[i]);
+	}
+	r->stored_pages -= cp->num_pages;
+	free(cp->pages);
+	free(cp->data);
+}
+
+void reverse_init(mips_sim_t *sim)
+{
+	sim->REVERSE = calloc(1, sizeof(reverse_t));
+	if (sim->REVERSE == NULL) {
+		printf("Error: out of memory allocating the reverse execution history\n");
+		exit(-1);
+	}
+	sim->REVERSE->interval = sim->REVERSE_INTERVAL;
+}
+
+/***************************************************************/
+/* Forget all history; the next run starts it again                              */
+/***************************************************************/
+void reverse_reset(mips_sim_t *sim)
+{
+	reverse_t *r = sim->REVERSE;
+	int i;
+
+	for (i = 0; i < r->num_checkpoints; i++) {
+		free_checkpoint(r, &r->checkpoints[i]);
+	}
+	r->num_checkpoints = 0;
+	r->num_written = 0;
+	r->num_values = r->value_cursor = 0;
+}
+
+void reverse_free(mips_sim_t *sim)
+{
+	if (sim->REVERSE) {
+		reverse_reset(sim);
+		free(sim->REVERSE->written);
+		free(sim->REVERSE->values);
+		free(sim->REVERSE);
+		sim->REVERSE = NULL;
+	}
+}
+
+/* mem_map_page() saw the first store to page since the newest checkpoint */
+void reverse_page_written(mips_sim_t *sim, uint32_t page)
+{
+	reverse_t *r = sim->REVERSE;
+
+	if (r->num_written == r->written_capacity) {
+		r->written = reverse_grow(r->written, &r->written_capacity, sizeof(uint32_t));
+	}
+	r->written[r->num_written++] = page;
+}
+
+/* fold checkpoint i into i + 1, which then also restores what i did */
+static void merge_checkpoint(reverse_t *r, int i)
+{
+	checkpoint_t *from = &r->checkpoints[i], *into = &r->checkpoints[i + 1];
+	uint32_t *pages = malloc((from->num_pages + into->num_pages + 1) * sizeof(uint32_t));
+	uint8_t **data = malloc((from->num_pages + into->num_pages + 1) * sizeof(uint8_t *));
+	uint32_t a = 0, b = 0, n = 0;
+
+	if (pages == NULL || data == NULL) {
+		printf("Error: out of memory merging checkpoints\n");
+		exit(-1);
+	}
+	/* both lists are sorted; where both have a page the later copy wins */
+	while (a < from->num_pages || b < into->num_pages) {
+		if (b == into->num_pages || (a < from->num_pages && from->pages[a] < into->pages[b])) {
+			pages[n] = from->pages[a];
+			data[n++] = from->data[a++];
+		} else {
+			if (a < from->num_pages && from->pages[a] == into->pages[b]) {
+				free(from->data[a++]);
+				r->stored_pages--;
+			}
+			pages[n] = into->pages[b];
+			data[n++] = into->data[b++];
+		}
+	}
+
+	free(from->pages);
+	free(from->data);
+	free(into->pages);
+	free(into->data);
+	into->pages = pages;
+	into->data = data;
+	into->num_pages = n;
+	memmove(from, from + 1, (r->num_checkpoints - i - 1) * sizeof(checkpoint_t));
+	r->num_checkpoints--;
+}
+
+/* drop checkpoints until the history is back under its limits */
+static void thin_checkpoints(mips_sim_t *sim)
+{
+	reverse_t *r = sim->REVERSE;
+	const checkpoint_t *cp = r->checkpoints;
+	uint64_t now = sim->INSTRUCTION_COUNT;
+	double score, best_score;
+	int i, best;
+
+	while (r->num_checkpoints > REVERSE_MAX_CHECKPOINTS ||
+	       (r->stored_pages > REVERSE_MAX_PAGES && r->num_checkpoints > 2)) {
+		/* never the first, which holds every page, nor the newest */
+		best = 1;
+		best_score = 0.0;
+		for (i = 1; i < r->num_checkpoints - 1; i++) {
+			score = (double)(cp[i + 1].count - cp[i - 1].count) / (now - cp[i - 1].count + 1);
+			if (i == 1 || score < best_score) {
+				best = i;
+				best_score = score;
+			}
+		}
+		merge_checkpoint(r, best);
+	}
+}
+
+/***************************************************************/
+/* Take a checkpoint now; the first one copies every owned page     */
+/***************************************************************/
+static void take_checkpoint(mips_sim_t *sim)
+{
+	reverse_t *r = sim->REVERSE;
+	checkpoint_t *cp = &r->checkpoints[r->num_checkpoints];
+	const uint32_t *pages = r->num_checkpoints ? r->written : sim->MEM_DIRTY_PAGES;
+	uint32_t i, page;
+
+	cp->count = sim->INSTRUCTION_COUNT;
+	cp->perf = sim->PERF;
+	cp->state = sim->CURRENT_STATE;
+	cp->run_flag = sim->RUN_FLAG;
+	cp->heap_break = sim->HEAP_BREAK;
+	cp->exit_code = sim->EXIT_CODE;
+	cp->values = r->value_cursor;
+	cp->num_pages = r->num_checkpoints ? r->num_written : sim->MEM_NUM_DIRTY;
+	cp->pages = malloc((cp->num_pages ? cp->num_pages : 1) * sizeof(uint32_t));
+	cp->data = malloc((cp->num_pages ? cp->num_pages : 1) * sizeof(uint8_t *));
+	if (cp->pages == NULL || cp->data == NULL) {
+		printf("Error: out of memory taking a checkpoint\n");
+		exit(-1);
+	}
+	memcpy(cp->pages, pages, cp->num_pages * sizeof(uint32_t));
+	qsort(cp->pages, cp->num_pages, sizeof(uint32_t), compare_pages);
+	for (i = 0; i < cp->num_pages; i++) {
+		page = cp->pages[i];
+		if ((cp->data[i] = malloc(MEM_PAGE_SIZE)) == NULL) {
+			printf("Error: out of memory taking a checkpoint\n");
+			exit(-1);
+		}
+		memcpy(cp->data[i], sim->MEM_PAGES[page], MEM_PAGE_SIZE);
+		sim->MEM_WRITE_PAGES[page] = NULL;
+	}
+	r->stored_pages += cp->num_pages;
+	r->num_checkpoints++;
+	r->num_written = 0;
+	r->next_due = cp->count + r->interval;
+	thin_checkpoints(sim);
+}
+
+/***************************************************************/
+/* How many of max_instructions to run before stopping for a          */
+/* checkpoint; takes the one that is due first                               */
+/***************************************************************/
+uint32_t reverse_chunk(mips_sim_t *sim, uint32_t max_instructions)
+{
+	reverse_t *r = sim->REVERSE;
+
+	if (r->num_checkpoints == 0 || sim->INSTRUCTION_COUNT >= r->next_due) {
+		take_checkpoint(sim);
+	}
+	return r->next_due - sim->INSTRUCTION_COUNT < max_instructions ? r->next_due - sim->INSTRUCTION_COUNT : max_instructions;
+}
+
+/***************************************************************/
+/* The front end changed registers: replaying from an earlier        */
+/* checkpoint would not, so checkpoint the change itself                 */
+/***************************************************************/
+void reverse_note_change(mips_sim_t *sim)
+{
+	reverse_t *r = sim->REVERSE;
+	checkpoint_t *newest;
+
+	if (r->num_checkpoints == 0) {
+		return;		/* the first checkpoint will see it */
+	}
+	newest = &r->checkpoints[r->num_checkpoints - 1];
+	if (newest->count == sim->INSTRUCTION_COUNT) {
+		newest->state = sim->CURRENT_STATE;
+	} else {
+		take_checkpoint(sim);
+	}
+}
+
+/***************************************************************/
+/* Outside values: re-executed syscalls take the ones they had     */
+/***************************************************************/
+int reverse_replayed_value(mips_sim_t *sim, uint32_t *value)
+{
+	reverse_t *r = sim->REVERSE;
+
+	if (r->value_cursor < r->num_values) {
+		*value = r->values[r->value_cursor++];
+		return TRUE;
+	}
+	return FALSE;
+}
+
+void reverse_keep_value(mips_sim_t *sim, uint32_t value)
+{
+	reverse_t *r = sim->REVERSE;
+
+	if (r->num_values == r->values_capacity) {
+		r->values = reverse_grow(r->values, &r->values_capacity, sizeof(uint32_t));
+	}
+	r->values[r->num_values++] = value;
+	r->value_cursor = r->num_values;
+}
+
+/* put page back as it was at checkpoint k */
+static void restore_page(mips_sim_t *sim, uint32_t page, int k)
+{
+	const checkpoint_t *cp;
+	const uint32_t *found;
+	int i;
+
+	for (i = k; i >= 0; i--) {
+		cp = &sim->REVERSE->checkpoints[i];
+		if ((found = bsearch(&page, cp->pages, cp->num_pages, sizeof(uint32_t), compare_pages)) != NULL) {
+			memcpy(sim->MEM_PAGES[page], cp->data[found - cp->pages], MEM_PAGE_SIZE);
+			break;
+		}
+	}
+	if (i < 0) {
+		/* first written after the first checkpoint, which held every page owned then */
+		const uint8_t *initial = mem_initial_page(sim, page);
+
+		if (initial) {
+			memcpy(sim->MEM_PAGES[page], initial, MEM_PAGE_SIZE);
+		} else {
+			memset(sim->MEM_PAGES[page], 0, MEM_PAGE_SIZE);
+		}
+	}
+	sim->MEM_WRITE_PAGES[page] = NULL;
+	if (page << MEM_PAGE_SHIFT <= MEM_TEXT_END) {
+		decode_invalidate_page(sim, page << MEM_PAGE_SHIFT);
+	}
+}
+
+/***************************************************************/
+/* Go back to instruction target, as far as the history reaches      */
+/***************************************************************/
+static void reverse_to(mips_sim_t *sim, uint64_t target)
+{
+	reverse_t *r = sim->REVERSE;
+	checkpoint_t *cp;
+	uint64_t host_ns;
+	uint32_t i;
+	int j, k;
+
+	if (r->num_checkpoints == 0) {
+		printf("Nothing has run yet.\n\n");
+		return;
+	}
+	if (target < r->checkpoints[0].count) {
+		printf("History only reaches back to instruction %llu.\n", (unsigned long long)r->checkpoints[0].count);
+		target = r->checkpoints[0].count;
+	}
+	for (k = r->num_checkpoints - 1; r->checkpoints[k].count > target; k--);
+
+	/* every page written since checkpoint k is listed by a later checkpoint or still writable */
+	for (j = k + 1; j < r->num_checkpoints; j++) {
+		cp = &r->checkpoints[j];
+		for (i = 0; i < cp->num_pages; i++) {
+			restore_page(sim, cp->pages[i], k);
+		}
+	}
+	for (i = 0; i < r->num_written; i++) {
+		restore_page(sim, r->written[i], k);
+	}
+	r->num_written = 0;
+
+	/* what followed k is gone; running forward takes its checkpoints again */
+	for (j = k + 1; j < r->num_checkpoints; j++) {
+		free_checkpoint(r, &r->checkpoints[j]);
+	}
+	r->num_checkpoints = k + 1;
+
+	cp = &r->checkpoints[k];
+	sim->CURRENT_STATE = cp->state;
+	sim->NEXT_STATE = cp->state;
+	sim->RUN_FLAG = cp->run_flag;
+	sim->HEAP_BREAK = cp->heap_break;
+	sim->EXIT_CODE = cp->exit_code;
+	sim->INSTRUCTION_COUNT = cp->count;
+	host_ns = sim->PERF.HOST_NS;
+	sim->PERF = cp->perf;
+	sim->PERF.HOST_NS = host_ns;
+	r->next_due = cp->count + r->interval;
+	r->value_cursor = cp->values;
+
+	if (target > cp->count) {
+		run_engine(sim, target - cp->count);
+	}
+	trace_flush(sim);
+	syscall_flush(sim);
+	/* values taken after target belong to the future just undone */
+	r->num_values = r->value_cursor;
+	printf("Back at instruction %llu, PC 0x%08x\n\n", (unsigned long long)sim->INSTRUCTION_COUNT, sim->CURRENT_STATE.PC);
+}
+
+/***************************************************************/
+/* rstep <n>: undo the last n instructions                                          */
+/***************************************************************/
+void reverse_step(mips_sim_t *sim, uint32_t n)
+{
+	reverse_to(sim, n < sim->INSTRUCTION_COUNT ? sim->INSTRUCTION_COUNT - n : 0);
+}
+
+/***************************************************************/
+/* rcontinue: back to the oldest point the history still holds      */
+/***************************************************************/
+void reverse_continue(mips_sim_t *sim)
+{
+	reverse_to(sim, sim->REVERSE->num_checkpoints ? sim->REVERSE->checkpoints[0].count : 0);
+}
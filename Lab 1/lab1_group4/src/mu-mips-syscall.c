@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* System calls                                                                                                              */
+/*                                                                                                                                      */
+/* SYSCALL looks its $v0 up in SYSCALL_TABLE, with the codes SPIM uses:          */
+/*	1  print_int	$a0 in decimal                                                                      */
+/*	4  print_string	the NUL-terminated string at $a0                                       */
+/*	5  read_int	a decimal integer from stdin into $v0, 0 in batch mode                  */
+/*	9  sbrk		grow the heap by $a0 bytes, old break in $v0 (-1 if it can't) */
+/*	10 exit		stop the program                                                                      */
+/*	17 exit2	stop the program with exit code $a0                                           */
+/* Any other code stops the program, as every SYSCALL did before.                 */
+/*                                                                                                                                      */
+/* Guest output collects in GUEST_OUTPUT and goes to GUEST_OUT in one write    */
+/* when the buffer fills, before a read, when the program exits and at the   */
+/* end of every run, so printing in a loop costs no stdio call per print.     */
+/* Built with tracing, it goes out after every syscall instead, in order with  */
+/* the trace lines.                                                                                          */
+/* read_int values go through replay_value(), so -record and -replay and       */
+/* rstep see the same input again.                                                                 */
+/***************************************************************/
+
+#define GUEST_OUTPUT_SIZE (1 << 20)
+#define HEAP_ALIGN        8		/* sbrk keeps the break aligned for doubleword data */
+
+typedef void (*syscall_handler_t)(mips_sim_t *sim, const CPU_State *cur, CPU_State *next);
+
+/***************************************************************/
+/* Write out whatever the guest printed                                                    */
+/***************************************************************/
+void syscall_flush(mips_sim_t *sim)
+{
+	if (sim->GUEST_OUTPUT_USED) {
+		fwrite(sim->GUEST_OUTPUT, 1, sim->GUEST_OUTPUT_USED, sim->GUEST_OUT ? sim->GUEST_OUT : stdout);
+		sim->GUEST_OUTPUT_USED = 0;
+	}
+}
+
+/* room for n more bytes of guest output */
+static char *output_reserve(mips_sim_t *sim, size_t n)
+{
+	if (sim->GUEST_OUTPUT == NULL) {
+		sim->GUEST_OUTPUT = malloc(GUEST_OUTPUT_SIZE);
+		if (sim->GUEST_OUTPUT == NULL) {
+			printf("Error: out of memory buffering guest output\n");
+			exit(-1);
+		}
+	}
+	if (sim->GUEST_OUTPUT_USED + n > GUEST_OUTPUT_SIZE) {
+		syscall_flush(sim);
+	}
+	return sim->GUEST_OUTPUT + sim->GUEST_OUTPUT_USED;
+}
+
+static void sys_print_int(mips_sim_t *sim, const CPU_State *cur, CPU_State *next)
+{
+	char digits[10], *out = output_reserve(sim, 11);
+	int32_t value = (int32_t)cur->REGS[4];
+	uint32_t magnitude = value < 0 ? 0u - (uint32_t)value : (uint32_t)value;
+	int n = 0;
+
+	do {
+		digits[n++] = '0' + magnitude % 10;
+		magnitude /= 10;
+	} while (magnitude);
+	if (value < 0) {
+		*out++ = '-';
+		sim->GUEST_OUTPUT_USED++;
+	}
+	sim->GUEST_OUTPUT_USED += n;
+	while (n) {
+		*out++ = digits[--n];
+	}
+}
+
+static void sys_print_string(mips_sim_t *sim, const CPU_State *cur, CPU_State *next)
+{
+	uint32_t address = cur->REGS[4];
+	uint8_t c;
+
+	/* unmapped memory reads as zero, so every string ends */
+	while ((c = mem_read_8(sim, address++)) != 0) {
+		*output_reserve(sim, 1) = c;
+		sim->GUEST_OUTPUT_USED++;
+	}
+}
+
+/* the next decimal integer on stdin, which the front end reads commands from too; 0 at
+ * end of input or if the line doesn't start with one */
+static uint32_t read_stdin_int(mips_sim_t *sim)
+{
+	int value, c;
+
+	if (sim->NO_GUEST_INPUT) {
+		return 0;
+	}
+	syscall_flush(sim);
+	fflush(stdout);
+	if (scanf("%d", &value) != 1) {
+		value = 0;
+	}
+	/* the rest of the line goes with it, like the rest of a command */
+	while ((c = getchar()) != '\n' && c != EOF) {
+	}
+	return (uint32_t)value;
+}
+
+static void sys_read_int(mips_sim_t *sim, const CPU_State *cur, CPU_State *next)
+{
+	next->REGS[2] = replay_value(sim, read_stdin_int);
+}
+
+static void sys_sbrk(mips_sim_t *sim, const CPU_State *cur, CPU_State *next)
+{
+	int64_t size = (int32_t)cur->REGS[4];
+	int64_t heap_break = (int64_t)sim->HEAP_BREAK + ((size + HEAP_ALIGN - 1) & ~(int64_t)(HEAP_ALIGN - 1));
+
+	/* pages are mapped when first written, so moving the break is all there is to it */
+	if (heap_break < MEM_HEAP_BEGIN || heap_break > MEM_HEAP_END + 1) {
+		next->REGS[2] = 0xFFFFFFFF;
+		return;
+	}
+	next->REGS[2] = sim->HEAP_BREAK;
+	sim->HEAP_BREAK = (uint32_t)heap_break;
+}
+
+static void sys_exit(mips_sim_t *sim, const CPU_State *cur, CPU_State *next)
+{
+	sim->RUN_FLAG = FALSE;
+	syscall_flush(sim);
+}
+
+static void sys_exit2(mips_sim_t *sim, const CPU_State *cur, CPU_State *next)
+{
+	sim->EXIT_CODE = (int32_t)cur->REGS[4];
+	sys_exit(sim, cur, next);
+}
+
+static const syscall_handler_t SYSCALL_TABLE[] = {
+	[1] = sys_print_int, [4] = sys_print_string, [5] = sys_read_int,
+	[9] = sys_sbrk, [10] = sys_exit, [17] = sys_exit2,
+};
+
+/***************************************************************/
+/* Run the system call $v0 asks for                                                         */
+/***************************************************************/
+void syscall_dispatch(mips_sim_t *sim, const CPU_State *cur, CPU_State *next)
+{
+	uint32_t code = cur->REGS[2];
+
+	/* trace lines sit in their own buffer, so while tracing both go out around every
+	 * syscall to keep the guest's output between the right lines */
+	if (TRACE_LEVEL > TRACE_OFF) {
+		trace_flush(sim);
+	}
+	if (code < sizeof(SYSCALL_TABLE) / sizeof(SYSCALL_TABLE[0]) && SYSCALL_TABLE[code]) {
+		SYSCALL_TABLE[code](sim, cur, next);
+	} else {
+		sys_exit(sim, cur, next);
+	}
+	if (TRACE_LEVEL > TRACE_OFF) {
+		syscall_flush(sim);
+	}
+}
+
+/***************************************************************/
+/* Back to an empty heap and no pending output                             */
+/***************************************************************/
+void syscall_reset(mips_sim_t *sim)
+{
+	syscall_flush(sim);
+	sim->HEAP_BREAK = MEM_HEAP_BEGIN;
+	sim->EXIT_CODE = 0;
+}
+
+void syscall_free(mips_sim_t *sim)
+{
+	syscall_flush(sim);
+	free(sim->GUEST_OUTPUT);
+	sim->GUEST_OUTPUT = NULL;
+}
@@ -3,9 +3,26 @@
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
+#include <stdarg.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "mu-mips.h"
 
+/***************************************************************/
+/* Memory regions every new simulator starts with                                                 */
+/***************************************************************/
+const mem_region_t DEFAULT_MEM_REGIONS[NUM_MEM_REGION] = {
+	{ MEM_TEXT_BEGIN, MEM_TEXT_END },
+	{ MEM_GP_BEGIN, MEM_GP_END },
+	{ MEM_DATA_BEGIN, MEM_DATA_END },
+	{ MEM_KDATA_BEGIN, MEM_KDATA_END },
+	{ MEM_KTEXT_BEGIN, MEM_KTEXT_END }
+};
+
 /***************************************************************/
 /* Print out a list of commands available                                                                  */
 /***************************************************************/
@@ -16,106 +33,343 @@ void help() {
 	printf("run <n>\t-- simulate program for <n> instructions\n");
 	printf("rdump\t-- dump register values\n");
 	printf("reset\t-- clears all registers/memory and re-loads the program\n");
+	printf("rstep <n>\t-- go back <n> instructions (with -reverse)\n");
+	printf("rcontinue\t-- go back as far as the checkpoints reach (with -reverse)\n");
 	printf("input <reg> <val>\t-- set GPR <reg> to <val>\n");
 	printf("mdump <start> <stop>\t-- dump memory from <start> to <stop> address\n");
 	printf("high <val>\t-- set the HI register to <val>\n");
 	printf("low <val>\t-- set the LO register to <val>\n");
 	printf("print\t-- print the program loaded into memory\n");
+	printf("profile\t-- show the most executed instructions and blocks with -profile, and functions with -calls\n");
 	printf("?\t-- display help menu\n");
 	printf("quit\t-- exit the simulator\n\n");
 	printf("------------------------------------------------------------------\n\n");
 }
 
 /***************************************************************/
-/* Read a 32-bit word from memory                                                                            */
+/* Back a guest page with private host memory on its first write    */
 /***************************************************************/
-uint32_t mem_read_32(uint32_t address)
+uint8_t *mem_map_page(mips_sim_t *sim, uint32_t address)
 {
 	int i;
+	uint32_t page = address >> MEM_PAGE_SHIFT;
+	uint8_t *private_page;
+	/* only reached once per page, so the region scan is off the hot path */
 	for (i = 0; i < NUM_MEM_REGION; i++) {
-		if ( (address >= MEM_REGIONS[i].begin) &&  ( address <= MEM_REGIONS[i].end) ) {
-			uint32_t offset = address - MEM_REGIONS[i].begin;
-			return (MEM_REGIONS[i].mem[offset+3] << 24) |
-					(MEM_REGIONS[i].mem[offset+2] << 16) |
-					(MEM_REGIONS[i].mem[offset+1] <<  8) |
-					(MEM_REGIONS[i].mem[offset+0] <<  0);
+		if ( (address >= sim->MEM_REGIONS[i].begin) && (address <= sim->MEM_REGIONS[i].end) ) {
+			break;
 		}
 	}
-	return 0;
+	if (i == NUM_MEM_REGION) {
+		return NULL;
+	}
+
+	/* write-protected by a checkpoint: the page is already ours, the history only needs to hear of it */
+	if (sim->REVERSE && sim->MEM_PAGES[page] && sim->MEM_PAGES[page] != mem_initial_page(sim, page)) {
+		reverse_page_written(sim, page);
+		return sim->MEM_WRITE_PAGES[page] = sim->MEM_PAGES[page];
+	}
+
+	if (sim->MEM_NUM_DIRTY == sim->MEM_DIRTY_CAPACITY) {
+		/* the free list never holds more pages than were ever dirty, so it grows alongside */
+		sim->MEM_DIRTY_CAPACITY = sim->MEM_DIRTY_CAPACITY ? 2 * sim->MEM_DIRTY_CAPACITY : 256;
+		sim->MEM_DIRTY_PAGES = realloc(sim->MEM_DIRTY_PAGES, sim->MEM_DIRTY_CAPACITY * sizeof(uint32_t));
+		sim->MEM_FREE_PAGES = realloc(sim->MEM_FREE_PAGES, sim->MEM_DIRTY_CAPACITY * sizeof(uint8_t *));
+		if (sim->MEM_DIRTY_PAGES == NULL || sim->MEM_FREE_PAGES == NULL) {
+			printf("Error: out of memory tracking dirty pages\n");
+			exit(-1);
+		}
+	}
+
+	private_page = sim->MEM_NUM_FREE ? sim->MEM_FREE_PAGES[--sim->MEM_NUM_FREE] : calloc(1, MEM_PAGE_SIZE);
+	if (private_page == NULL) {
+		printf("Error: out of memory mapping address 0x%08x\n", address);
+		exit(-1);
+	}
+	/* a page still shared with the program image is copied on its first write */
+	if (sim->MEM_PAGES[page]) {
+		memcpy(private_page, sim->MEM_PAGES[page], MEM_PAGE_SIZE);
+	}
+	sim->MEM_PAGES[page] = sim->MEM_WRITE_PAGES[page] = private_page;
+	sim->MEM_DIRTY_PAGES[sim->MEM_NUM_DIRTY++] = page;
+	if (sim->REVERSE) {
+		reverse_page_written(sim, page);
+	}
+	return private_page;
+}
+
+static int compare_file_pages(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
 }
 
 /***************************************************************/
-/* Write a 32-bit word to memory                                                                                */
+/* What a page held when the program was loaded, NULL for zeros    */
 /***************************************************************/
-void mem_write_32(uint32_t address, uint32_t value)
+const uint8_t *mem_initial_page(const mips_sim_t *sim, uint32_t page)
 {
+	const uint32_t *found;
+
+	if (sim->IMAGE) {
+		return sim->IMAGE->MEM_PAGES[page];
+	}
+	found = bsearch(&page, sim->MEM_FILE_PAGES, sim->MEM_NUM_FILE, sizeof(uint32_t), compare_file_pages);
+	return found ? sim->MEM_FILE_DATA[found - sim->MEM_FILE_PAGES] : NULL;
+}
+
+/***************************************************************/
+/* Copy size bytes into guest memory a page at a time, for loaders  */
+/***************************************************************/
+void mem_write_block(mips_sim_t *sim, uint32_t address, const uint8_t *data, uint32_t size)
+{
+	uint32_t n;
+	uint8_t *page;
+
+	while (size) {
+		n = MEM_PAGE_SIZE - (address & MEM_PAGE_MASK);
+		if (n > size) {
+			n = size;
+		}
+		page = sim->MEM_WRITE_PAGES[address >> MEM_PAGE_SHIFT];
+		if (page || (page = mem_map_page(sim, address))) {
+			memcpy(page + (address & MEM_PAGE_MASK), data, n);
+		}
+		if (address <= MEM_TEXT_END) {
+			decode_invalidate_page(sim, address);
+		}
+		address += n;
+		data += n;
+		size -= n;
+	}
+}
+
+/***************************************************************/
+/* Byte-at-a-time word accesses, for unaligned and big-endian cases */
+/***************************************************************/
+static uint32_t mem_read_32_slow(mips_sim_t *sim, uint32_t address)
+{
+	uint32_t value = 0;
 	int i;
-	uint32_t offset;
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		if ( (address >= MEM_REGIONS[i].begin) && (address <= MEM_REGIONS[i].end) ) {
-			offset = address - MEM_REGIONS[i].begin;
-
-			MEM_REGIONS[i].mem[offset+3] = (value >> 24) & 0xFF;
-			MEM_REGIONS[i].mem[offset+2] = (value >> 16) & 0xFF;
-			MEM_REGIONS[i].mem[offset+1] = (value >>  8) & 0xFF;
-			MEM_REGIONS[i].mem[offset+0] = (value >>  0) & 0xFF;
-			
+	/* bytes are fetched one at a time so a word may straddle two pages */
+	for (i = 3; i >= 0; i--) {
+		uint32_t byte_address = address + i;
+		uint8_t *page = sim->MEM_PAGES[byte_address >> MEM_PAGE_SHIFT];
+		value = (value << 8) | (page ? page[byte_address & MEM_PAGE_MASK] : 0);
+	}
+	return value;
+}
+
+static void mem_write_32_slow(mips_sim_t *sim, uint32_t address, uint32_t value)
+{
+	int i;
+	for (i = 0; i < 4; i++) {
+		uint32_t byte_address = address + i;
+		uint8_t *page = sim->MEM_WRITE_PAGES[byte_address >> MEM_PAGE_SHIFT];
+		if (page == NULL && (page = mem_map_page(sim, byte_address)) == NULL) {
+			continue; /* outside every region: the write is dropped */
 		}
+		page[byte_address & MEM_PAGE_MASK] = (value >> (8 * i)) & 0xFF;
 	}
-	
-	
+	/* an unaligned word overlaps two instructions */
+	decode_invalidate(sim, address);
+	decode_invalidate(sim, address + 3);
+}
+
+/***************************************************************/
+/* Read a 32-bit word from memory                                                                            */
+/***************************************************************/
+uint32_t mem_read_32(mips_sim_t *sim, uint32_t address)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	/* guest memory is little-endian like the host, and an aligned word never crosses a page */
+	if ((address & 3) == 0) {
+		uint8_t *page = sim->MEM_PAGES[address >> MEM_PAGE_SHIFT];
+		return page ? *(uint32_t *)(page + (address & MEM_PAGE_MASK)) : 0;
+	}
+#endif
+	return mem_read_32_slow(sim, address);
+}
+
+/***************************************************************/
+/* Write a 32-bit word to memory                                                                                */
+/***************************************************************/
+void mem_write_32(mips_sim_t *sim, uint32_t address, uint32_t value)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if ((address & 3) == 0) {
+		uint8_t *page = sim->MEM_WRITE_PAGES[address >> MEM_PAGE_SHIFT];
+		if (page || (page = mem_map_page(sim, address))) {
+			*(uint32_t *)(page + (address & MEM_PAGE_MASK)) = value;
+		}
+		/* text sits below every other region, so data stores skip this on one compare */
+		if (address <= MEM_TEXT_END) {
+			decode_invalidate(sim, address);
+		}
+		return;
+	}
+#endif
+	mem_write_32_slow(sim, address, value);
+}
+
+/***************************************************************/
+/* Byte and halfword accesses for LB/LH/SB/SH                                         */
+/***************************************************************/
+uint8_t mem_read_8(mips_sim_t *sim, uint32_t address)
+{
+	uint8_t *page = sim->MEM_PAGES[address >> MEM_PAGE_SHIFT];
+	return page ? page[address & MEM_PAGE_MASK] : 0;
+}
+
+void mem_write_8(mips_sim_t *sim, uint32_t address, uint8_t value)
+{
+	uint8_t *page = sim->MEM_WRITE_PAGES[address >> MEM_PAGE_SHIFT];
+	if (page || (page = mem_map_page(sim, address))) {
+		page[address & MEM_PAGE_MASK] = value;
+	}
+	if (address <= MEM_TEXT_END) {
+		decode_invalidate(sim, address);
+	}
+}
+
+uint16_t mem_read_16(mips_sim_t *sim, uint32_t address)
+{
+	return mem_read_8(sim, address) | (mem_read_8(sim, address + 1) << 8);
+}
+
+void mem_write_16(mips_sim_t *sim, uint32_t address, uint16_t value)
+{
+	mem_write_8(sim, address, value & 0xFF);
+	mem_write_8(sim, address + 1, value >> 8);
 }
 
 /***************************************************************/
 /* Execute one cycle                                                                                                              */
 /***************************************************************/
-void cycle() {                                                
-	handle_instruction();
-	CURRENT_STATE = NEXT_STATE;
-	INSTRUCTION_COUNT++;
+void cycle(mips_sim_t *sim) {                                                
+	handle_instruction(sim);
+	/* in place, CURRENT_STATE already is the next state; run(sim) re-syncs NEXT_STATE once at the end */
+	if (!sim->STATE_IN_PLACE) {
+		sim->CURRENT_STATE = sim->NEXT_STATE;
+	}
+	sim->INSTRUCTION_COUNT++;
+}
+
+/***************************************************************/
+/* Run up to n instructions, sampled or not, and add the host time */
+/***************************************************************/
+static uint32_t run_timed(mips_sim_t *sim, uint32_t n) {
+	struct timespec start, stop;
+	uint32_t retired;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	retired = sim->SAMPLE_WINDOW ? run_sampled(sim, n) : run_engine(sim, n);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	sim->PERF.HOST_NS += (uint64_t)(stop.tv_sec - start.tv_sec) * 1000000000u + stop.tv_nsec - start.tv_nsec;
+	return retired;
 }
 
 /***************************************************************/
 /* Simulate MIPS for n cycles                                                                                       */
 /***************************************************************/
-void run(int num_cycles) {                                      
+void run(mips_sim_t *sim, int num_cycles) {                                      
 	
-	if (RUN_FLAG == FALSE) {
+	if (sim->RUN_FLAG == FALSE) {
 		printf("Simulation Stopped\n\n");
 		return;
 	}
 
 	printf("Running simulator for %d cycles...\n\n", num_cycles);
-	int i;
-	for (i = 0; i < num_cycles; i++) {
-		if (RUN_FLAG == FALSE) {
-			printf("Simulation Stopped.\n\n");
-			break;
-		}
-		cycle();
+	/* the engines count unsigned, so a negative count would run to completion */
+	if (num_cycles <= 0) {
+		return;
+	}
+	if (run_timed(sim, num_cycles) < num_cycles) {
+		printf("Simulation Stopped.\n\n");
+	}
+	trace_flush(sim);
+	syscall_flush(sim);
+	if (sim->ENGINE == ENGINE_PIPELINE || sim->SAMPLE_WINDOW) {
+		pipe_report(sim, stdout);
+	}
+	if (sim->NUM_BPRED) {
+		bpred_report(sim, stdout);
 	}
 }
 
 /***************************************************************/
 /* simulate to completion                                                                                               */
 /***************************************************************/
-void runAll() {                                                     
-	if (RUN_FLAG == FALSE) {
+void runAll(mips_sim_t *sim) {                                                     
+	if (sim->RUN_FLAG == FALSE) {
 		printf("Simulation Stopped.\n\n");
 		return;
 	}
 
 	printf("Simulation Started...\n\n");
-	while (RUN_FLAG){
-		cycle();
-	}
+	run_to_completion(sim, 0);
 	printf("Simulation Finished.\n\n");
+	if (sim->ENGINE == ENGINE_PIPELINE || sim->SAMPLE_WINDOW) {
+		pipe_report(sim, stdout);
+	}
+	if (sim->NUM_BPRED) {
+		bpred_report(sim, stdout);
+	}
+}
+
+/***************************************************************/
+/* Run until the program stops, or max_instructions (0: no limit) retire */
+/***************************************************************/
+void run_to_completion(mips_sim_t *sim, uint32_t max_instructions) {
+	uint32_t retired = 0, budget;
+
+	while (sim->RUN_FLAG && (max_instructions == 0 || retired < max_instructions)) {
+		budget = max_instructions ? max_instructions - retired : UINT32_MAX;
+		retired += run_timed(sim, budget);
+	}
+	trace_flush(sim);
+	syscall_flush(sim);
+}
+
+/***************************************************************/
+/* The engine loop itself, blind to checkpoints                              */
+/***************************************************************/
+static uint32_t run_selected_engine(mips_sim_t *sim, uint32_t max_instructions) {
+	uint32_t i;
+
+	switch (sim->ENGINE) {
+		case ENGINE_THREADED: return run_threaded(sim, max_instructions);
+		case ENGINE_BLOCK:
+		case ENGINE_JIT:      return run_blocks(sim, max_instructions);
+		case ENGINE_PIPELINE: return run_pipeline(sim, max_instructions);
+	}
+	for (i = 0; i < max_instructions && sim->RUN_FLAG; i++) {
+		cycle(sim);
+	}
+	sim->NEXT_STATE = sim->CURRENT_STATE;
+	return i;
+}
+
+/***************************************************************/
+/* Run up to max_instructions on the selected engine; returns how many retired */
+/***************************************************************/
+uint32_t run_engine(mips_sim_t *sim, uint32_t max_instructions) {
+	uint32_t retired = 0;
+
+	if (sim->REVERSE) {
+		/* stop wherever a checkpoint is due */
+		do {
+			retired += run_selected_engine(sim, reverse_chunk(sim, max_instructions - retired));
+		} while (retired < max_instructions && sim->RUN_FLAG);
+		return retired;
+	}
+	return run_selected_engine(sim, max_instructions);
 }
 
 /***************************************************************/ 
 /* Dump a word-aligned region of memory to the terminal                              */
 /***************************************************************/
-void mdump(uint32_t start, uint32_t stop) {          
+void mdump(mips_sim_t *sim, uint32_t start, uint32_t stop) {          
 	uint32_t address;
 
 	printf("-------------------------------------------------------------\n");
@@ -123,7 +377,7 @@ void mdump(uint32_t start, uint32_t stop) {
 	printf("-------------------------------------------------------------\n");
 	printf("\t[Address in Hex (Dec) ]\t[Value]\n");
 	for (address = start; address <= stop; address += 4){
-		printf("\t0x%08x (%d) :\t0x%08x\n", address, address, mem_read_32(address));
+		printf("\t0x%08x (%d) :\t0x%08x\n", address, address, mem_read_32(sim, address));
 	}
 	printf("\n");
 }
@@ -131,1469 +385,1512 @@ void mdump(uint32_t start, uint32_t stop) {
 /***************************************************************/
 /* Dump current values of registers to the teminal                                              */   
 /***************************************************************/
-void rdump() {                               
+void rdump(mips_sim_t *sim) {                               
 	int i; 
 	printf("-------------------------------------\n");
 	printf("Dumping Register Content\n");
 	printf("-------------------------------------\n");
-	printf("# Instructions Executed\t: %u\n", INSTRUCTION_COUNT);
-	printf("PC\t: 0x%08x\n", CURRENT_STATE.PC);
+	printf("# Instructions Executed\t: %llu\n", (unsigned long long)sim->INSTRUCTION_COUNT);
+	printf("# Loads / Stores\t: %llu / %llu\n", (unsigned long long)sim->PERF.LOADS, (unsigned long long)sim->PERF.STORES);
+	printf("# Branches Taken / Not\t: %llu / %llu\n", (unsigned long long)sim->PERF.BRANCHES_TAKEN,
+	       (unsigned long long)sim->PERF.BRANCHES_NOT_TAKEN);
+	printf("# Jumps / Syscalls\t: %llu / %llu\n", (unsigned long long)sim->PERF.JUMPS, (unsigned long long)sim->PERF.SYSCALLS);
+	if (sim->SHOW_HOST_TIME) {
+		printf("Host time\t: %.3f s\n", sim->PERF.HOST_NS / 1e9);
+	}
+	printf("PC\t: 0x%08x\n", sim->CURRENT_STATE.PC);
 	printf("-------------------------------------\n");
 	printf("[Register]\t[Value]\n");
 	printf("-------------------------------------\n");
 	for (i = 0; i < MIPS_REGS; i++){
-		printf("[R%d]\t: 0x%08x\n", i, CURRENT_STATE.REGS[i]);
+		printf("[R%d]\t: 0x%08x\n", i, sim->CURRENT_STATE.REGS[i]);
 	}
 	printf("-------------------------------------\n");
-	printf("[HI]\t: 0x%08x\n", CURRENT_STATE.HI);
-	printf("[LO]\t: 0x%08x\n", CURRENT_STATE.LO);
+	printf("[HI]\t: 0x%08x\n", sim->CURRENT_STATE.HI);
+	printf("[LO]\t: 0x%08x\n", sim->CURRENT_STATE.LO);
 	printf("-------------------------------------\n");
 }
 
+/***************************************************************/
+/* The profiles asked for on the command line, before exiting       */
+/***************************************************************/
+static void exit_reports(mips_sim_t *sim)
+{
+	if (sim->PROFILE) {
+		profile_report(sim);
+		if (sim->CALLGRAPH) {
+			callgraph_report(sim);
+		}
+	}
+	if (sim->CALLGRAPH_FILE) {
+		callgraph_write_folded(sim, sim->CALLGRAPH_FILE);
+	}
+}
+
+/***************************************************************/
+/* Carry out one command, typed or replayed                                   */
+/***************************************************************/
+void execute_command(mips_sim_t *sim, const command_t *c) {
+	switch (c->kind) {
+		case CMD_SIM:
+			runAll(sim);
+			break;
+		case CMD_RUN:
+			run(sim, (int)c->arg[0]);
+			break;
+		case CMD_RDUMP:
+			rdump(sim);
+			break;
+		case CMD_RESET:
+			if (!reset(sim)) {
+				exit(-1);
+			}
+			break;
+		case CMD_INPUT:
+			/* a damaged log must not write outside the register file */
+			if (c->arg[0] < MIPS_REGS) {
+				sim->CURRENT_STATE.REGS[c->arg[0]] = c->arg[1];
+				sim->NEXT_STATE.REGS[c->arg[0]] = c->arg[1];
+			}
+			if (sim->REVERSE) {
+				reverse_note_change(sim);
+			}
+			break;
+		case CMD_HIGH:
+			sim->CURRENT_STATE.HI = c->arg[0];
+			sim->NEXT_STATE.HI = c->arg[0];
+			if (sim->REVERSE) {
+				reverse_note_change(sim);
+			}
+			break;
+		case CMD_LOW:
+			sim->CURRENT_STATE.LO = c->arg[0];
+			sim->NEXT_STATE.LO = c->arg[0];
+			if (sim->REVERSE) {
+				reverse_note_change(sim);
+			}
+			break;
+		case CMD_RSTEP:
+		case CMD_RCONTINUE:
+			if (sim->REVERSE == NULL) {
+				printf("Reverse execution needs -reverse <interval>.\n");
+			} else if (c->kind == CMD_RSTEP) {
+				reverse_step(sim, c->arg[0]);
+			} else {
+				reverse_continue(sim);
+			}
+			break;
+		case CMD_MDUMP:
+			mdump(sim, c->arg[0], c->arg[1]);
+			break;
+		case CMD_PRINT:
+			print_program(sim);
+			break;
+		case CMD_PROFILE:
+			if (sim->PROFILE) {
+				profile_report(sim);
+			} else if (sim->CALLGRAPH == NULL) {
+				printf("Profiling is off; start the simulator with -profile to count instructions.\n");
+			}
+			if (sim->CALLGRAPH) {
+				callgraph_report(sim);
+			}
+			break;
+		case CMD_HELP:
+			help();
+			break;
+		case CMD_QUIT:
+			exit_reports(sim);
+			record_close(sim);
+			printf("**************************\n");
+			printf("Exiting MU-MIPS! Good Bye...\n");
+			printf("**************************\n");
+			exit(0);
+	}
+}
+
 /***************************************************************/
 /* Read a command from standard input.                                                               */  
 /***************************************************************/
-void handle_command() {                         
+void handle_command(mips_sim_t *sim) {                         
 	char buffer[20];
-	uint32_t start, stop, cycles;
-	uint32_t register_no;
-	int register_value;
-	int hi_reg_value, lo_reg_value;
+	command_t c = { 0 };
+	int value;
 
 	printf("MU-MIPS SIM:> ");
 
 	if (scanf("%s", buffer) == EOF){
+		exit_reports(sim);
+		record_close(sim);
 		exit(0);
 	}
 
 	switch(buffer[0]) {
 		case 'S':
 		case 's':
-			runAll(); 
+			c.kind = CMD_SIM;
 			break;
 		case 'M':
 		case 'm':
-			if (scanf("%x %x", &start, &stop) != 2){
-				break;
+			if (scanf("%x %x", &c.arg[0], &c.arg[1]) != 2){
+				return;
 			}
-			mdump(start, stop);
+			c.kind = CMD_MDUMP;
 			break;
 		case '?':
-			help();
+			c.kind = CMD_HELP;
 			break;
 		case 'Q':
 		case 'q':
-			printf("**************************\n");
-			printf("Exiting MU-MIPS! Good Bye...\n");
-			printf("**************************\n");
-			exit(0);
+			c.kind = CMD_QUIT;
+			break;
 		case 'R':
 		case 'r':
 			if (buffer[1] == 'd' || buffer[1] == 'D'){
-				rdump();
+				c.kind = CMD_RDUMP;
 			}else if(buffer[1] == 'e' || buffer[1] == 'E'){
-				reset();
+				c.kind = CMD_RESET;
+			}else if(buffer[1] == 's' || buffer[1] == 'S'){
+				if (scanf("%u", &c.arg[0]) != 1) {
+					return;
+				}
+				c.kind = CMD_RSTEP;
+			}else if(buffer[1] == 'c' || buffer[1] == 'C'){
+				c.kind = CMD_RCONTINUE;
 			}
 			else {
-				if (scanf("%d", &cycles) != 1) {
-					break;
+				if (scanf("%d", &value) != 1) {
+					return;
 				}
-				run(cycles);
+				c.kind = CMD_RUN;
+				c.arg[0] = value;
 			}
 			break;
 		case 'I':
 		case 'i':
-			if (scanf("%u %i", &register_no, &register_value) != 2){
-				break;
+			if (scanf("%u %i", &c.arg[0], &value) != 2){
+				return;
 			}
-			CURRENT_STATE.REGS[register_no] = register_value;
-			NEXT_STATE.REGS[register_no] = register_value;
+			c.kind = CMD_INPUT;
+			c.arg[1] = value;
 			break;
 		case 'H':
 		case 'h':
-			if (scanf("%i", &hi_reg_value) != 1){
-				break;
+			if (scanf("%i", &value) != 1){
+				return;
 			}
-			CURRENT_STATE.HI = hi_reg_value; 
-			NEXT_STATE.HI = hi_reg_value; 
+			c.kind = CMD_HIGH;
+			c.arg[0] = value;
 			break;
 		case 'L':
 		case 'l':
-			if (scanf("%i", &lo_reg_value) != 1){
-				break;
+			if (scanf("%i", &value) != 1){
+				return;
 			}
-			CURRENT_STATE.LO = lo_reg_value;
-			NEXT_STATE.LO = lo_reg_value;
+			c.kind = CMD_LOW;
+			c.arg[0] = value;
 			break;
 		case 'P':
 		case 'p':
-			print_program(); 
+			c.kind = buffer[2] == 'o' || buffer[2] == 'O' ? CMD_PROFILE : CMD_PRINT;
 			break;
 		default:
 			printf("Invalid Command.\n");
-			break;
+			return;
+	}
+
+	/* logged before it runs, so values the run asks for follow it in the log */
+	if (sim->RECORD_FILE) {
+		record_command(sim, &c);
+	}
+	execute_command(sim, &c);
+}
+
+/***************************************************************/
+/* Map the image's pages read-only; writes copy them first            */
+/***************************************************************/
+static void map_image(mips_sim_t *sim)
+{
+	const mips_sim_t *image = sim->IMAGE;
+	uint32_t i, page;
+
+	for (i = 0; i < image->MEM_NUM_DIRTY; i++) {
+		page = image->MEM_DIRTY_PAGES[i];
+		sim->MEM_PAGES[page] = image->MEM_PAGES[page];
+	}
+	for (i = 0; i < image->MEM_NUM_FILE; i++) {
+		page = image->MEM_FILE_PAGES[i];
+		sim->MEM_PAGES[page] = image->MEM_PAGES[page];
 	}
+	sim->PROGRAM_START = image->PROGRAM_START;
+	sim->PROGRAM_SIZE = image->PROGRAM_SIZE;
+	/* an ELF image starts at its entry point with its $gp */
+	sim->CURRENT_STATE.PC = image->CURRENT_STATE.PC;
+	sim->CURRENT_STATE.REGS[28] = image->CURRENT_STATE.REGS[28];
+	sim->NEXT_STATE = sim->CURRENT_STATE;
 }
 
 /***************************************************************/
 /* reset registers/memory and reload program                                                    */
 /***************************************************************/
-void reset() {   
+int reset(mips_sim_t *sim) {   
 	int i;
 	/*reset registers*/
 	for (i = 0; i < MIPS_REGS; i++){
-		CURRENT_STATE.REGS[i] = 0;
+		sim->CURRENT_STATE.REGS[i] = 0;
 	}
-	CURRENT_STATE.HI = 0;
-	CURRENT_STATE.LO = 0;
+	sim->CURRENT_STATE.HI = 0;
+	sim->CURRENT_STATE.LO = 0;
 	
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-		memset(MEM_REGIONS[i].mem, 0, region_size);
+	/*drop every touched page, memory reads back as zero*/
+	free_memory(sim);
+	memset(&sim->PIPE, 0, sizeof(sim->PIPE));
+	bpred_reset(sim);
+	profile_clear(sim);
+	syscall_reset(sim);
+	if (sim->REVERSE) {
+		reverse_reset(sim);
 	}
 	
-	/*load program*/
-	load_program();
-	
 	/*reset PC*/
-	INSTRUCTION_COUNT = 0;
-	CURRENT_STATE.PC =  MEM_TEXT_BEGIN;
-	NEXT_STATE = CURRENT_STATE;
-	RUN_FLAG = TRUE;
+	sim->INSTRUCTION_COUNT = 0;
+	memset(&sim->PERF, 0, sizeof(sim->PERF));
+	sim->CURRENT_STATE.PC =  MEM_TEXT_BEGIN;
+	sim->NEXT_STATE = sim->CURRENT_STATE;
+	sim->RUN_FLAG = TRUE;
+
+	/*load program, or share the one already loaded*/
+	if (sim->IMAGE) {
+		map_image(sim);
+	} else if (!load_program(sim)) {
+		return FALSE;
+	}
+	/* the root frame is named after the entry point, which an ELF program moves */
+	if (sim->CALLGRAPH) {
+		callgraph_reset(sim);
+	}
+	return TRUE;
 }
 
 /***************************************************************/
-/* Allocate and set memory to zero                                                                            */
+/* Start with every page unmapped; pages come on first write      */
 /***************************************************************/
-void init_memory() {                                           
+void init_memory(mips_sim_t *sim) {                                           
+	/* MEM_PAGES arrives zeroed from sim_create()'s calloc, which the kernel hands out
+	 * lazily, so clearing it here would only pull the whole 8 MB table into RSS */
+	memcpy(sim->MEM_REGIONS, DEFAULT_MEM_REGIONS, sizeof(DEFAULT_MEM_REGIONS));
+}
+
+/***************************************************************/
+/* Unmap every page written since the last reset, leaving memory all zero */
+/***************************************************************/
+void free_memory(mips_sim_t *sim) {
+	uint32_t i, page;
+	/* cost follows the program's footprint, not the size of the address space */
+	for (i = 0; i < sim->MEM_NUM_DIRTY; i++) {
+		page = sim->MEM_DIRTY_PAGES[i];
+		memset(sim->MEM_PAGES[page], 0, MEM_PAGE_SIZE);
+		decode_invalidate_page(sim, page << MEM_PAGE_SHIFT);
+		sim->MEM_FREE_PAGES[sim->MEM_NUM_FREE++] = sim->MEM_PAGES[page];
+		sim->MEM_PAGES[page] = sim->MEM_WRITE_PAGES[page] = NULL;
+	}
+	sim->MEM_NUM_DIRTY = 0;
+	elf_unmap(sim);
+
+	/* pages shared with the image are only unmapped; the image never changes, so what
+	 * was decoded from them stays valid for the next run */
+	if (sim->IMAGE) {
+		for (i = 0; i < sim->IMAGE->MEM_NUM_DIRTY; i++) {
+			sim->MEM_PAGES[sim->IMAGE->MEM_DIRTY_PAGES[i]] = NULL;
+		}
+		for (i = 0; i < sim->IMAGE->MEM_NUM_FILE; i++) {
+			sim->MEM_PAGES[sim->IMAGE->MEM_FILE_PAGES[i]] = NULL;
+		}
+	}
+}
+
+
+/**************************************************************/
+/* Hex program parsing                                                                                            */
+/**************************************************************/
+#define LOAD_CHUNK_WORDS (MEM_PAGE_SIZE / 4)	/* words parsed before each bulk write */
+
+/* 0x10 | value for a hex digit, 0 for anything else, so ANDing the entries of
+ * a run of characters tests them all at once */
+static const uint8_t HEX_DIGITS[256] = {
+	['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14,
+	['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19,
+	['a'] = 0x1a, ['b'] = 0x1b, ['c'] = 0x1c, ['d'] = 0x1d, ['e'] = 0x1e, ['f'] = 0x1f,
+	['A'] = 0x1a, ['B'] = 0x1b, ['C'] = 0x1c, ['D'] = 0x1d, ['E'] = 0x1e, ['F'] = 0x1f,
+};
+
+/* the hex word at p, as fscanf's %x reads it; returns the end of the word, NULL if there is none */
+static const uint8_t *parse_hex_word(const uint8_t *p, const uint8_t *end, uint32_t *word)
+{
+	const uint8_t *digits;
+	uint32_t value = 0;
+	uint8_t t[8];
 	int i;
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-		MEM_REGIONS[i].mem = malloc(region_size);
-		memset(MEM_REGIONS[i].mem, 0, region_size);
+
+	/* nearly every word is exactly eight digits, checked and combined without a branch per digit */
+	if (end - p > 8) {
+		for (i = 0; i < 8; i++) {
+			t[i] = HEX_DIGITS[p[i]];
+		}
+		if (t[0] & t[1] & t[2] & t[3] & t[4] & t[5] & t[6] & t[7] & ~HEX_DIGITS[p[8]] & 0x10) {
+			*word = ((uint32_t)(t[0] & 0xF) << 28) | ((t[1] & 0xF) << 24) | ((t[2] & 0xF) << 20) | ((t[3] & 0xF) << 16) |
+				((t[4] & 0xF) << 12) | ((t[5] & 0xF) << 8) | ((t[6] & 0xF) << 4) | (t[7] & 0xF);
+			return p + 8;
+		}
+	}
+
+	/* anything else: an optional 0x, then any number of digits */
+	if (end - p > 2 && p[0] == '0' && (p[1] | 0x20) == 'x' && HEX_DIGITS[p[2]]) {
+		p += 2;
+	}
+	for (digits = p; p < end && HEX_DIGITS[*p]; p++) {
+		value = (value << 4) | (HEX_DIGITS[*p] & 0xF);
+	}
+	*word = value;
+	return p > digits ? p : NULL;
+}
+
+/***************************************************************/
+/* Record why prog_file didn't load, print it unless quiet; FALSE   */
+/***************************************************************/
+int load_failed(mips_sim_t *sim, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(sim->LOAD_ERROR, sizeof(sim->LOAD_ERROR), format, args);
+	va_end(args);
+	if (!sim->QUIET) {
+		printf("Error: %s: %s\n", sim->prog_file, sim->LOAD_ERROR);
+	}
+	return FALSE;
+}
+
+/* the whole file, mapped when it can be and read in one go when it can't (pipes) */
+static uint8_t *read_program_file(mips_sim_t *sim, size_t *size, int *mapped)
+{
+	struct stat st;
+	uint8_t *data = NULL;
+	size_t capacity = 0;
+	ssize_t n;
+	int fd;
+
+	*size = 0;
+	*mapped = FALSE;
+	if ((fd = open(sim->prog_file, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return MAP_FAILED;
+	}
+	if (S_ISREG(st.st_mode) && st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			*size = st.st_size;
+			*mapped = TRUE;
+			close(fd);
+			return data;
+		}
+		data = NULL;
+	}
+	do {
+		if (*size == capacity) {
+			capacity = capacity ? 2 * capacity : 1 << 16;
+			if ((data = realloc(data, capacity)) == NULL) {
+				printf("Error: out of memory reading %s\n", sim->prog_file);
+				exit(-1);
+			}
+		}
+		n = read(fd, data + *size, capacity - *size);
+		*size += n > 0 ? n : 0;
+	} while (n > 0);
+	close(fd);
+	return data;
+}
+
+static void release_program_file(uint8_t *data, size_t size, int mapped)
+{
+	if (mapped) {
+		munmap(data, size);
+	} else {
+		free(data);
 	}
 }
 
 /**************************************************************/
 /* load program into memory                                                                                      */
 /**************************************************************/
-void load_program() {                   
-	FILE * fp;
-	int i, word;
-	uint32_t address;
+int load_program(mips_sim_t *sim) {                   
+	const uint8_t *p, *end;
+	uint8_t *data, chunk[4 * LOAD_CHUNK_WORDS];
+	uint32_t word, used = 0, address = MEM_TEXT_BEGIN;
+	size_t size;
+	int mapped, ok = TRUE;
+
+	/* Read in the whole file at once. */
+	data = read_program_file(sim, &size, &mapped);
+	if (data == MAP_FAILED) {
+		return load_failed(sim, "can't open program file");
+	}
 
-	/* Open program file. */
-	fp = fopen(prog_file, "r");
-	if (fp == NULL) {
-		printf("Error: Can't open program file %s\n", prog_file);
-		exit(-1);
+	/* an ELF executable rather than a hex listing */
+	if (size >= 4 && memcmp(data, "\x7f" "ELF", 4) == 0) {
+		release_program_file(data, size, mapped);
+		return load_elf(sim);
+	}
+
+	/* parse a page of words at a time and copy each page in with one write */
+	for (p = data, end = data + size; ; ) {
+		while (p < end && (*p == ' ' || (*p >= '\t' && *p <= '\r'))) {
+			p++;
+		}
+		if (p == end) {
+			break;
+		}
+		if ((p = parse_hex_word(p, end, &word)) == NULL) {
+			ok = load_failed(sim, "word %u is not a hex number", (address - MEM_TEXT_BEGIN + used) / 4 + 1);
+			break;
+		}
+		/* guest memory is little-endian */
+		chunk[used] = word;
+		chunk[used + 1] = word >> 8;
+		chunk[used + 2] = word >> 16;
+		chunk[used + 3] = word >> 24;
+		if ((used += 4) == sizeof(chunk)) {
+			mem_write_block(sim, address, chunk, used);
+			address += used;
+			used = 0;
+		}
+	}
+	mem_write_block(sim, address, chunk, used);
+	address += used;
+	release_program_file(data, size, mapped);
+
+	sim->PROGRAM_START = MEM_TEXT_BEGIN;
+	sim->PROGRAM_SIZE = (address - MEM_TEXT_BEGIN) / 4;
+	if (ok && !sim->QUIET) {
+		printf("Program loaded into memory: %u words at 0x%08x.\n\n", sim->PROGRAM_SIZE, MEM_TEXT_BEGIN);
+	}
+	return ok;
+}
+
+/************************************************************/
+/* Instruction handlers, one per operation                  */
+/************************************************************/
+static void op_nop(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { }
+//a load into $0: nothing to do, but it still counts as a load
+static void op_nop_load(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { }
+
+//ALU instructions
+static void op_add(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { next->REGS[d->rd] = cur->REGS[d->rs] + cur->REGS[d->rt]; }
+static void op_sub(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { next->REGS[d->rd] = cur->REGS[d->rs] - cur->REGS[d->rt]; }
+static void op_and(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { next->REGS[d->rd] = cur->REGS[d->rs] & cur->REGS[d->rt]; }
+static void op_or(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next)  { next->REGS[d->rd] = cur->REGS[d->rs] | cur->REGS[d->rt]; }
+static void op_xor(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { next->REGS[d->rd] = cur->REGS[d->rs] ^ cur->REGS[d->rt]; }
+static void op_nor(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { next->REGS[d->rd] = ~(cur->REGS[d->rs] | cur->REGS[d->rt]); }
+static void op_slt(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { next->REGS[d->rd] = (int32_t)cur->REGS[d->rs] < (int32_t)cur->REGS[d->rt]; }
+static void op_sll(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { next->REGS[d->rd] = cur->REGS[d->rt] << d->shamt; }
+static void op_srl(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { next->REGS[d->rd] = cur->REGS[d->rt] >> d->shamt; }
+static void op_sra(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { next->REGS[d->rd] = (uint32_t)((int32_t)cur->REGS[d->rt] >> d->shamt); }
+
+//HI/LO instructions
+static void op_mult(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next)
+{
+	int64_t product = (int64_t)(int32_t)cur->REGS[d->rs] * (int32_t)cur->REGS[d->rt];
+	next->HI = (uint32_t)((uint64_t)product >> 32);
+	next->LO = (uint32_t)product;
+}
+static void op_multu(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next)
+{
+	uint64_t product = (uint64_t)cur->REGS[d->rs] * cur->REGS[d->rt];
+	next->HI = (uint32_t)(product >> 32);
+	next->LO = (uint32_t)product;
+}
+static void op_div(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next)
+{
+	int32_t dividend = (int32_t)cur->REGS[d->rs], divisor = (int32_t)cur->REGS[d->rt];
+	//the result of dividing by zero is unpredictable on MIPS; HI and LO are left alone
+	if (divisor == 0) {
+		return;
+	}
+	//-2^31 / -1 overflows in C, MIPS wraps it
+	if (divisor == -1) {
+		next->LO = 0 - (uint32_t)dividend;
+		next->HI = 0;
+		return;
+	}
+	next->LO = (uint32_t)(dividend / divisor);
+	next->HI = (uint32_t)(dividend % divisor);
+}
+static void op_divu(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next)
+{
+	uint32_t dividend = cur->REGS[d->rs], divisor = cur->REGS[d->rt];
+	if (divisor == 0) {
+		return;
 	}
+	next->LO = dividend / divisor;
+	next->HI = dividend % divisor;
+}
+static void op_mfhi(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { next->REGS[d->rd] = cur->HI; }
+static void op_mflo(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { next->REGS[d->rd] = cur->LO; }
+static void op_mthi(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { next->HI = cur->REGS[d->rs]; }
+static void op_mtlo(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { next->LO = cur->REGS[d->rs]; }
+
+//Immediate instructions (d->imm is already sign- or zero-extended as the opcode requires)
+static void op_addi(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { next->REGS[d->rt] = cur->REGS[d->rs] + d->imm; }
+static void op_slti(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { next->REGS[d->rt] = (int32_t)cur->REGS[d->rs] < (int32_t)d->imm; }
+static void op_andi(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { next->REGS[d->rt] = cur->REGS[d->rs] & d->imm; }
+static void op_ori(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next)  { next->REGS[d->rt] = cur->REGS[d->rs] | d->imm; }
+static void op_xori(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { next->REGS[d->rt] = cur->REGS[d->rs] ^ d->imm; }
+static void op_lui(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next)  { next->REGS[d->rt] = d->imm; }
+
+//Load/Store instructions
+static void op_lw(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { next->REGS[d->rt] = mem_read_32(sim, cur->REGS[d->rs] + d->imm); }
+static void op_lb(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { next->REGS[d->rt] = (uint32_t)(int32_t)(int8_t)mem_read_8(sim, cur->REGS[d->rs] + d->imm); }
+static void op_lh(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { next->REGS[d->rt] = (uint32_t)(int32_t)(int16_t)mem_read_16(sim, cur->REGS[d->rs] + d->imm); }
+static void op_sw(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { mem_write_32(sim, cur->REGS[d->rs] + d->imm, cur->REGS[d->rt]); }
+static void op_sb(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { mem_write_8(sim, cur->REGS[d->rs] + d->imm, cur->REGS[d->rt] & 0xFF); }
+static void op_sh(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { mem_write_16(sim, cur->REGS[d->rs] + d->imm, cur->REGS[d->rt] & 0xFFFF); }
+
+//Control flow instructions (d->imm holds the absolute target, next->PC the return address)
+static void op_beq(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next)  { if (cur->REGS[d->rs] == cur->REGS[d->rt]) next->PC = d->imm; }
+static void op_bne(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next)  { if (cur->REGS[d->rs] != cur->REGS[d->rt]) next->PC = d->imm; }
+static void op_blez(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { if ((int32_t)cur->REGS[d->rs] <= 0) next->PC = d->imm; }
+static void op_bgtz(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { if ((int32_t)cur->REGS[d->rs] > 0) next->PC = d->imm; }
+static void op_bltz(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { if ((int32_t)cur->REGS[d->rs] < 0) next->PC = d->imm; }
+static void op_bgez(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { if ((int32_t)cur->REGS[d->rs] >= 0) next->PC = d->imm; }
+static void op_j(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next)    { next->PC = d->imm; }
+static void op_jal(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next)  { next->REGS[31] = next->PC; next->PC = d->imm; }
+static void op_jr(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next)   { next->PC = cur->REGS[d->rs]; }
+static void op_jalr(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next)
+{
+	uint32_t target = cur->REGS[d->rs];
+	next->REGS[d->rd] = next->PC;
+	next->PC = target;
+}
+
+//System call
+static void op_syscall(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { syscall_dispatch(sim, cur, next); }
 
-	/* Read in the program. */
+//Coprocessor 0 (the counters count every instruction before this one; the engines see to that)
+static uint32_t cp0_read(const mips_sim_t *sim, int reg, int sel)
+{
+	const perf_counters_t *p = &sim->PERF;
 
-	i = 0;
-	while( fscanf(fp, "%x\n", &word) != EOF ) {
-		address = MEM_TEXT_BEGIN + i;
-		mem_write_32(address, word);
-		printf("writing 0x%08x into address 0x%08x (%d)\n", word, address, address);
-		i += 4;
+	if (reg == CP0_COUNT) {
+		return (uint32_t)sim->INSTRUCTION_COUNT;
+	}
+	if (reg == CP0_PERFCNT) {
+		switch (sel) {
+			case 0: return (uint32_t)p->LOADS;
+			case 1: return (uint32_t)p->STORES;
+			case 2: return (uint32_t)p->BRANCHES_TAKEN;
+			case 3: return (uint32_t)p->BRANCHES_NOT_TAKEN;
+			case 4: return (uint32_t)p->JUMPS;
+			case 5: return (uint32_t)p->SYSCALLS;
+		}
 	}
-	PROGRAM_SIZE = i/4;
-	printf("Program loaded into memory.\n%d words written into memory.\n\n", PROGRAM_SIZE);
-	fclose(fp);
+	return 0;
 }
+static void op_mfc0(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next) { next->REGS[d->rt] = cp0_read(sim, d->rd, d->imm & 7); }
 
 /************************************************************/
-/* decode and execute instruction                                                                     */ 
+/* Decode tables, generated from mips-isa.def               */
 /************************************************************/
-void handle_instruction()
+enum { IMM_NONE, IMM_SIGN, IMM_ZERO, IMM_UPPER, IMM_BRANCH, IMM_JUMP };
+enum { DEST_NONE, DEST_RD, DEST_RT, DEST_RA };
+enum {
+	SYNTAX_NONE, SYNTAX_WORD, SYNTAX_RD_RS_RT, SYNTAX_RD_RT_SA, SYNTAX_RS_RT, SYNTAX_RD, SYNTAX_RS, SYNTAX_RD_RS,
+	SYNTAX_RT_RS_IMM, SYNTAX_RT_IMM, SYNTAX_RT_OFFSET_RS, SYNTAX_RS_RT_TARGET, SYNTAX_RS_TARGET, SYNTAX_TARGET, SYNTAX_RT_CP0
+};
+
+typedef struct {
+	const char *mnemonic;
+	uint8_t op;		/* OP_* that executes it */
+	uint8_t imm;		/* IMM_*: how decode extends the immediate */
+	uint8_t dest;		/* DEST_*: register written, for the $0 check */
+	uint8_t syntax;		/* SYNTAX_*: operand layout for print_instruction */
+} inst_info_t;
+
+/* one INST_* per row of the spec; INST_invalid is every encoding it doesn't list and
+ * INST_special/INST_regimm/INST_cop0 send the opcode lookup on to the funct, rt and rs tables */
+enum {
+	INST_invalid, INST_special, INST_regimm, INST_cop0,
+#define OPCODE(name, code, handler, imm, dest, class, syntax) INST_##name,
+#define SPECIAL OPCODE
+#define REGIMM  OPCODE
+#define COP0    OPCODE
+#include "mips-isa.def"
+#undef OPCODE
+#undef SPECIAL
+#undef REGIMM
+#undef COP0
+	NUM_INSTS
+};
+
+static const inst_info_t INST_INFO[NUM_INSTS] = {
+	[INST_invalid] = { ".word", OP_nop, IMM_NONE, DEST_NONE, SYNTAX_WORD }, //unimplemented instructions fall through to the next one
+#define OPCODE(name, code, handler, imm, dest, class, syntax) \
+	[INST_##name] = { #name, OP_##handler, IMM_##imm, DEST_##dest, SYNTAX_##syntax },
+#define SPECIAL OPCODE
+#define REGIMM  OPCODE
+#define COP0    OPCODE
+#include "mips-isa.def"
+#undef OPCODE
+#undef SPECIAL
+#undef REGIMM
+#undef COP0
+};
+
+//instruction bits 31..26
+static const uint8_t OPCODE_TABLE[64] = {
+	[0x00] = INST_special, [0x01] = INST_regimm, [0x10] = INST_cop0,
+#define OPCODE(name, code, ...) [code] = INST_##name,
+#define SPECIAL(...)
+#define REGIMM(...)
+#define COP0(...)
+#include "mips-isa.def"
+#undef OPCODE
+#undef SPECIAL
+#undef REGIMM
+#undef COP0
+};
+
+//bits 5..0 when the opcode is 0x00
+static const uint8_t FUNCT_TABLE[64] = {
+#define OPCODE(...)
+#define SPECIAL(name, code, ...) [code] = INST_##name,
+#define REGIMM(...)
+#define COP0(...)
+#include "mips-isa.def"
+#undef OPCODE
+#undef SPECIAL
+#undef REGIMM
+#undef COP0
+};
+
+//bits 20..16 when the opcode is 0x01
+static const uint8_t REGIMM_TABLE[32] = {
+#define OPCODE(...)
+#define SPECIAL(...)
+#define REGIMM(name, code, ...) [code] = INST_##name,
+#define COP0(...)
+#include "mips-isa.def"
+#undef OPCODE
+#undef SPECIAL
+#undef REGIMM
+#undef COP0
+};
+
+//bits 25..21 when the opcode is 0x10
+static const uint8_t COP0_TABLE[32] = {
+#define OPCODE(...)
+#define SPECIAL(...)
+#define REGIMM(...)
+#define COP0(name, code, ...) [code] = INST_##name,
+#include "mips-isa.def"
+#undef OPCODE
+#undef SPECIAL
+#undef REGIMM
+#undef COP0
+};
+
+const uint8_t OP_CLASS[NUM_OPS] = {
+	[OP_nop] = CLASS_ALU,
+	[OP_nop_load] = CLASS_LOAD,
+#define OPCODE(name, code, handler, imm, dest, class, syntax) [OP_##handler] = CLASS_##class,
+#define SPECIAL OPCODE
+#define REGIMM  OPCODE
+#define COP0    OPCODE
+#include "mips-isa.def"
+#undef OPCODE
+#undef SPECIAL
+#undef REGIMM
+#undef COP0
+};
+
+#define OP_HANDLER(name) op_##name,
+static const inst_handler_t OP_HANDLERS[NUM_OPS] = { MIPS_OPS(OP_HANDLER) };
+#undef OP_HANDLER
+
+/* at most two table loads per instruction word */
+static const inst_info_t *inst_lookup(uint32_t instruction)
 {
-	/*IMPLEMENT THIS*/
-	/* execute one instruction at a time. Use/update CURRENT_STATE and and NEXT_STATE, as necessary.*/
-	
-	uint32_t rs;
-	uint32_t rt;
-	uint32_t rd;
-	uint32_t immediate_value;
-	uint32_t immediate_value_unsign;
-	uint32_t offset_value;
-	uint32_t Op_upper;
-	uint32_t target_value;
-	uint32_t immediate_sign_decode;
-	uint32_t immediate_value_decode;
-
-	//Gives the current instruction in hexadecimal
-	uint32_t instruction = mem_read_32(CURRENT_STATE.PC);
-	
-	//print the instruction
-	printf("\nInstruction = %08x ", instruction);
-	
-	//Decode the opcode from the instruction
-	uint32_t opcode = (0xFC000000 & instruction); //masking the instruction with 1111 1100 0000 0000 0000 0000 0000 0000 (FC000000)
-	printf("\nOpcode = 0x%08x ",opcode);
-	
-	//knowing the type of the opcode
-	switch (opcode) {
-		
-		/***********************************************************R-Type************************************************************************/
-		case 0x00000000:
-		printf("\n This is a R-type instruction");
-		//get the address value of rs 
-		rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-	        rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		//get the address value of rd
-		rd = (0x0000F800 & instruction) >> 11;//Masking with 0000 0000 0000 0000 1111 1000 0000 0000 (0000F800)
-		printf("\n rd = %d", rd);
-		
-		//get the value of shift amount
-		uint32_t sa = (0x000007C0 & instruction) >> 6;//Masking with 0000 0000 0000 0000 0000 0111 1100 0000 (000007C0) 
-		printf("\n sa = %d", sa);
-		
-		//decoding the function bit
-		uint32_t function = (0x0000003F & instruction); //Masking with 0000 0000 0000 0000 0000 0000 0011 1111 (0000003F)
-		printf("\n function = 0x%08x\n", function);
-		
-				switch (function) {
-					
-					/***********************************ALU instruction**********************************************/
-					
-					/*************--ADD function*******************/
-					case 0x00000020:
-					printf("\n This is an ADD function");
-					NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs] + CURRENT_STATE.REGS[rt];
-					//NEXT_STATE.REGS[rd] = 4+ 2;
-					//printf("rd result = %d", NEXT_STATE.REGS[rd]);
-					//RUN_FLAG = FALSE;
-					break;
-					
-					/***********--ADDU function*******************/
-					case 0x00000021:
-					printf("\n This is an ADDU function");
-					NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs] + CURRENT_STATE.REGS[rt]; 
-					break;
-					
-					/***********--SUB function********************/
-					case 0x00000022:
-					printf("\n This is an SUB function");
-					NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs] - CURRENT_STATE.REGS[rt];
-					break;
-					
-					/***********--SUBU function******************/
-					case 0x00000023:
-					printf("\n This is an SUBU function");
-					NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs] - CURRENT_STATE.REGS[rt];
-					break;
-					
-					/************--AND function*****************/
-					case 0x00000024:
-					printf("\n This is an AND function");
-					NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs] & CURRENT_STATE.REGS[rt];
-					break;
-					
-					/**************--OR function****************/
-					case 0x00000025:
-					printf("\n This is an OR function");
-					NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs] | CURRENT_STATE.REGS[rt];
-					break;
-					
-					/****************--XOR function*************/ 
-					//(if rs and rt is different, rd = 1 else if rs and rt are same then rd is 0)
-					case 0x00000026:
-					printf("\n This is an XOR function");
-					NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs] ^ CURRENT_STATE.REGS[rt];
-					break;
-					
-					/************NOR function ( !(rs or rt) )***/
-				        /*case 0x00000027:
-					printf("\n This is an NOR function");
-					NEXT_STATE.REGS[rd] = !(CURRENT_STATE.REGS[rs] | CURRENT_STATE.REGS[rt]);
-					break; */
-					
-					/************SLT function*******************/ 
-					//(Set on Less Than, if rs < rt then rd = 1, if rs > rt then rd = 0)
-					/*case 0x0000002A:
-					printf("\n This is an SLT function");
-					if (CURRENT_STATE.REGS[rs] < CURRENT_STATE.REGS[rt])
-					{
-						NEXT_STATE.REGS[rd] = 0x00000001;
-					}
-					else 
-					{
-						NEXT_STATE.REGS[rd] = 0x00000000;
-					}						
-					
-					break;*/
-					
-					/****SLL function (Shift Left Logical)cycle**/
-					/*case 0x00000000:
-					printf("\n This is an SLL function");
-					NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rt] << sa; 
-					break;
-				        */
-	
-					/*****--SRL function (Shit Right Logical)****/
-					case 0x00000002:
-					printf("\n This is an SRL function");
-					NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rt] >> sa; 
-					break;
-					
-					/**--SRA function (Shift Right Arithmetic)***/
-					case 0x00000003:
-					printf("\n This is an SRA function");
-					NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rt] >> sa; 
-					break;
-					
-					/*****MULT function (Multiply)***************/
-					/*case 0x00000018:
-					printf("\n This is a multiply function");
-					int64_t mult_HI = ((int32_t (CURRENT_STATE.REGS[rs] ) *  (int32_t(CURRENT_STATE.REGS[rt]) )) & uint64_t(0xffffffff00000000));
-					NEXT_STATE.HI =  int32_t (mult_HI);
-					
-					int64_t mult_L0 = (((int32_t (CURRENT_STATE.REGS[rs] )) *  (int32_t(CURRENT_STATE.REGS[rt]) ))& uint64_t(0x00000000ffffffff));
-					NEXT_STATE.LO = int32_t (mult_LO);
-					break;
-					
-					/******MULTU (Multiply unisgned)************/
-					/*case 0x00000019:
-					printf("\n This is a multiply unsinged function");
-					uint64_t mult_HI = (((uint32_t (CURRENT_STATE.REGS[rs] )) *  (uint32_t(CURRENT_STATE.REGS[rt]) ))& uint64_t(0xffffffff00000000));
-					NEXT_STATE.HI =  uint32_t (mult_HI);
-						
-					uint64_t mult_L0 = (((uint32_t (CURRENT_STATE.REGS[rs] )) *  (uint32_t(CURRENT_STATE.REGS[rt]) ))& uint64_t(0x00000000ffffffff));
-					NEXT_STATE.LO = uint32_t (mult_LO);
-					break;*/
-					
-					/**********DIV (Divide function)***********/
-					/*case 0x0000001A:
-					printf("\n This is a divide function");
-					(NEXT_STATE.LO) = (CURRENT_STATE.REGS[rs]) / (CURRENT_STATE.REGS[rt]);
-					(NEXT_STATE.H1) = (CURRENT_STATE.REGS[rs]) % (CURRENT_STATE.REGS[rt]);
-					break;*/
-					
-					/******DIVU (Divide unsigned function)****/
-					/*case 0x0000001B:
-					printf("\n This is a divide unsigned function");
-					NEXT_STATE.LO = (CURRENT_STATE.REGS[rs]) / (CURRENT_STATE.REGS[rt]);
-					NEXT_STATE.H1 = (CURRENT_STATE.REGS[rs]) % (CURRENT_STATE.REGS[rt]);
-					break;*/
-				
-					/**************************************Load Instruction*************************************************/
-					
-					/*//MFHI function (Move from HI)
-					case 0x00000010:
-					printf("\n This is an MFHI function");
-					NEXT_STATE.REGS[rd] = CURRENT_STATE.HI; 
-					break;
-					
-					//MFLO function (Move From LO)
-					case 0x00000012:
-					printf("\n This is an MFLO function");
-					NEXT_STATE.REGS[rd] = CURRENT_STATE.LO; 
-					break;
-					
-					//MTHI function (Move To HI)
-					case 0x00000011:
-					printf("\n This is an MTHI function");
-					CURRENT_STATE.HI = CURRENT_STATE.REGS[rs]; 
-					break;printf("\n This is a R-type instruction");
-					//get the address value of rs 
-					rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-					printf("\n rs = %d", rs);
-					
-					//get the address value of rt
-					rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-					printf("\n rt = %d", rt);
-					
-					//get the address value of rd
-					rd = (0x0000F800 & instruction) >> 11;//Masking with 0000 0000 0000 0000 1111 1000 0000 0000 (0000F800)
-					printf("\n rd = %d", rd);
-		
-					
-					//MTLO function (Move To LO)
-					case 0x00000013:
-					printf("\n This is an MTLO function");
-					CURRENT_STATE.LO = CURRENT_STATE.REGS[rs]; 
-					break;
-				        */	
-
-					/**************************************Control Flow Instructions**************************************/
-					/*//JR function (Jump Register)
-					case 0x00000008:printf("\n This is a R-type instruction");
-					//get the address value of rs 
-					rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-					printf("\n rs = %d", rs);
-					
-					//get the address value of rt
-					rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-					printf("\n rt = %d", rt);
-					
-					//get the address value of rd
-					rd = (0x0000F800 & instruction) >> 11;//Masking with 0000 0000 0000 0000 1111 1000 0000 0000 (0000F800)
-					printf("\n rd = %d", rd);
-		
-					printf("\n This is an JR function"); 
-					NEXT_STATE.PC = CURRENT_STATE.REGS[rs];            
-					break;
-					
-					//JALR function (Jump And Link Register)
-					case 0x00000009:
-					printf("\n This is an 10JALR function"); 
-					NEXT_STATE.REGS[rd] = CURRENT_STATE.PC + 8;            
-					NEXT_STATE.PC = CURRENT_STATE.REGS[rs]              
-					break;
-					
-					*/	
-
-					case 0x0000000c:
-					RUN_FLAG = FALSE;
-					break;
-					
-
-			} //End of inner switch case (i.e., function of R-type)
-		
-		
-		break; //This is case R-type break
-	
-		
-		/***********************************************************I-Type*****************************************************************************/
-			
-		/*****************--(ADDI - Add immediate )*******************/
-		case  0x20000000:
-		printf("\n This is a I-type instruction");
-		//get the address value of rs 
-		rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		//get the immediate value and sign extend it
-		immediate_value_decode = (0x0000FFFF & instruction);
-		immediate_sign_decode = (0x0000FFFF & instruction)>>15; // Masking with 0000 0000 0000 0000 1111 1111 1111 1111
-		
-			switch(immediate_sign_decode){
-
-			case 0x00000001:
-			immediate_value = (immediate_value_decode | 0Xffff0000);
-			break;
-			
-			case 0x00000000: 
-			immediate_value = (immediate_value_decode | 0X000000000);
-			break;
-			
-			}
+	uint8_t index = OPCODE_TABLE[instruction >> 26];
+
+	if (index == INST_special) {
+		index = FUNCT_TABLE[0x0000003F & instruction];
+	} else if (index == INST_regimm) {
+		index = REGIMM_TABLE[(0x001F0000 & instruction) >> 16];
+	} else if (index == INST_cop0) {
+		index = COP0_TABLE[(0x03E00000 & instruction) >> 21];
+	}
+	return &INST_INFO[index];
+}
 
-		NEXT_STATE.REGS[rt] = CURRENT_STATE.REGS[rs] + immediate_value;
-		break;
-			
-
-		/***********--(ADDIU- Add immediate unisigned)************/
-		case 0x24000000:
-		printf("\n This is a I-type instruction");
-		//get the address value of rs 
-		rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		immediate_value_unsign = (0x0000FFFF & instruction); // Masking with 0000 0000 0000 0000 1111 1111 1111 1111
-		
-		NEXT_STATE.REGS[rt] = CURRENT_STATE.REGS[rs] + immediate_value_unsign;
-		break;
-			
-			
-		/*************--(ANDI- AND immediate)*******************/
-		case 0x30000000:
-		//get the address value of rs 
-		rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		immediate_value_unsign = (0x0000FFFF & instruction); // Masking with 0000 0000 0000 0000 1111 1111 1111 1111
-		NEXT_STATE.REGS[rt] = CURRENT_STATE.REGS[rs] & immediate_value_unsign;
-		break;
-			
-
-		/*****************--(ORI- OR immediate)*****************/
-		case 0x34000000:
-		//get the address value of rs 
-		rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		immediate_value_unsign = (0x0000FFFF & instruction); // Masking with 0000 0000 0000 0000 1111 1111 1111 1111
-		NEXT_STATE.REGS[rt] = CURRENT_STATE.REGS[rs] | immediate_value_unsign;
-		break;
-
-
-		/****************--(XORI- Exclusive OR immediate)******/
-		case 0x38000000:
-		//get the address value of rs 
-		rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		immediate_value_unsign = (0x0000FFFF & instruction); // Masking with 0000 0000 0000 0000 1111 1111 1111 1111
-		NEXT_STATE.REGS[rt] = CURRENT_STATE.REGS[rs] ^ immediate_value_unsign;
-		break;
-			
-		
-		//(SLTI- Set on less than immediate)
-		/*case 0x28000000:
-		
-		//get the address value of rs 
-		uint32_t rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		uint32_t rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		int32_t immediate_value = (0x0000FFFF & instruction); // Masking with 0000 0000 0000 0000 1111 1111 1111 1111
-		if (CURRENT_STATE.REGS[rs] < immediate_value )
-		{
-			NEXT_STATE.REGS[rt] = 0x00000001;
+/************************************************************/
+/* Decode one instruction word into a handler and its fields */
+/************************************************************/
+void decode_instruction(uint32_t pc, uint32_t instruction, decoded_inst_t *d)
+{
+	const inst_info_t *info = inst_lookup(instruction);
+	uint32_t immediate_value = (uint32_t)(int32_t)(int16_t)(0x0000FFFF & instruction); //sign extended
+
+	d->instruction = instruction;
+	d->rs = (0x03E00000 & instruction) >> 21;
+	d->rt = (0x001F0000 & instruction) >> 16;
+	d->rd = (0x0000F800 & instruction) >> 11;
+	d->shamt = (0x000007C0 & instruction) >> 6;
+	d->op = info->op;
+
+	switch (info->imm) {
+		case IMM_ZERO:   d->imm = 0x0000FFFF & instruction; break;
+		case IMM_UPPER:  d->imm = (0x0000FFFF & instruction) << 16; break;
+		case IMM_BRANCH: d->imm = pc + (immediate_value << 2); break;
+		case IMM_JUMP:   d->imm = (pc & 0xF0000000) | ((0x03FFFFFF & instruction) << 2); break;
+		default:         d->imm = immediate_value; break;
+	}
+
+	//$0 is hard-wired to zero, so an instruction whose only effect is writing it does nothing;
+	//a load still reads memory as far as the counters and the pipeline are concerned
+	if ((info->dest == DEST_RD && d->rd == 0) || (info->dest == DEST_RT && d->rt == 0)) {
+		d->op = OP_CLASS[d->op] == CLASS_LOAD ? OP_nop_load : OP_nop;
+	}
+	//JALR still jumps when it links into $0
+	if (d->op == OP_jalr && d->rd == 0) {
+		d->op = OP_jr;
+	}
+	d->handler = OP_HANDLERS[d->op];
+}
+
+/************************************************************/
+/* Return the decoded instruction at pc, decoding it on first use */
+/************************************************************/
+const decoded_inst_t *decode_fetch(mips_sim_t *sim, uint32_t pc)
+{
+	uint32_t offset = pc - MEM_TEXT_BEGIN;
+	decoded_inst_t *slots, *d;
+
+	//only the text segment is cached; anything else is decoded every time
+	if (offset > MEM_TEXT_END - MEM_TEXT_BEGIN || (pc & 3)) {
+		decode_instruction(pc, mem_read_32(sim, pc), &sim->UNCACHED);
+		return &sim->UNCACHED;
+	}
+
+	slots = sim->DECODE_CACHE[offset >> MEM_PAGE_SHIFT];
+	if (slots == NULL) {
+		slots = calloc(DECODE_SLOTS, sizeof(decoded_inst_t));
+		if (slots == NULL) {
+			printf("Error: out of memory decoding address 0x%08x\n", pc);
+			exit(-1);
 		}
-		else 
-		{
-			NEXT_STATE.REGS[rt] = 0x00000000;
+		sim->DECODE_CACHE[offset >> MEM_PAGE_SHIFT] = slots;
+
+		/* counters outlive the records, which are dropped whenever the page is rewritten */
+		if (sim->PROFILE && sim->PROFILE_COUNTS[offset >> MEM_PAGE_SHIFT] == NULL &&
+		    (sim->PROFILE_COUNTS[offset >> MEM_PAGE_SHIFT] = calloc(DECODE_SLOTS, sizeof(uint64_t))) == NULL) {
+			printf("Error: out of memory profiling address 0x%08x\n", pc);
+			exit(-1);
 		}
+	}
 
-		break;
-		
-		*/
-	
-		/*****************--(LW- Load Word)******************/
-		case 0x8C000000:
-		//get the address value of rs 
-		rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		//get the immediate value and sign extend it
-		immediate_value_decode = (0x0000FFFF & instruction);
-		immediate_sign_decode = (0x0000FFFF & instruction)>>15; // Masking with 0000 0000 0000 0000 1111 1111 1111 1111
-			switch(immediate_sign_decode){
-
-			case 0x00000001:
-			immediate_value = (immediate_value_decode | 0Xffff0000);
-			break;
-				
-			case 0x00000000: 
-			immediate_value = (immediate_value_decode | 0X000000000);
-			break;
+	d = &slots[(offset & MEM_PAGE_MASK) >> 2];
+	if (d->handler == NULL) {
+		decode_instruction(pc, mem_read_32(sim, pc), d);
+	}
+	return d;
+}
 
-			}
-				
-		
-		NEXT_STATE.REGS[rt] = mem_read_32(CURRENT_STATE.REGS[rs] + immediate_value + 0x10010000);
-		break;
-		
-
-		
-		//(LB- Load Byte)
-		/*case 0x80000000:
-		//get the address value of rs 
-		uint32_t rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		uint32_t rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		int32_t offset_value = (0x0000FFFF & instruction); // Masking with 0000 0000 0000 0000 1111 1111 1111 1111(sign extended)
-		int8_t(NEXT_STATE.REGS[rt]) = int8_t mem_read_32(CURRENT_STATE.REGS[rs] + offset_value);
-		break;
-			
-		printf("\n This is a R-type instruction");
-		//get the address value of rs 
-		rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-	        rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		//get the address value of rd
-		rd = (0x0000F800 & instruction) >> 11;//Masking with 0000 0000 0000 0000 1111 1000 0000 0000 (0000F800)
-		printf("\n rd = %d", rd);
-		
-			
-		//(LH- Load half word)
-		case 0x84000000:
-		//get the address value of rs 
-		uint32_t rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		uint32_t rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		int32_t offset_value = (0x0000FFFF & instruction); // Masking with 0000 0000 0000 0000 1111 1111 1111 1111
-		int16_t(NEXT_STATE.REGS[rt]) = int16_t mem_read_32(CURRENT_STATE.REGS[rs] + offset_value);
-		break;
-		
-		*/	
-		
-		/****************--(LUI- Load upper immediate)***************/
-		case 0x3C000000:
-		//get the address value of rs 
-		rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		//get the immediate value and sign extend it
-		immediate_value_decode = (0x0000FFFF & instruction);
-		immediate_sign_decode = (0x0000FFFF & instruction)>>15; // Masking with 0000 0000 0000 0000 1111 1111 1111 1111
-		
-			switch(immediate_sign_decode){
-
-			case 0x00000001:
-			immediate_value = (immediate_value_decode | 0Xffff0000);
-			break;
-			
-			case 0x00000000: 
-			immediate_value = (immediate_value_decode | 0X000000000);
-			break;
+/************************************************************/
+/* Re-decode the word at address after the guest writes it  */
+/************************************************************/
+void decode_invalidate(mips_sim_t *sim, uint32_t address)
+{
+	uint32_t offset = address - MEM_TEXT_BEGIN;
+	decoded_inst_t *slots, *d;
 
-			}
+	if (offset > MEM_TEXT_END - MEM_TEXT_BEGIN) {
+		return;
+	}
+	slots = sim->DECODE_CACHE[offset >> MEM_PAGE_SHIFT];
+	if (slots == NULL) {
+		return;
+	}
+	/* decode again right away rather than clearing the record: a block may be
+	 * executing it, and it must never see a half-invalid record */
+	d = &slots[(offset & MEM_PAGE_MASK) >> 2];
+	if (d->handler) {
+		decode_instruction(address & ~3, mem_read_32(sim, address & ~3), d);
+		sim->BLOCKS_STALE = TRUE;
+	}
+}
 
-		NEXT_STATE.REGS[rt] = immediate_value << 16;
-		break;
-			
-		
-		/********************--(SW- Store word)********************/
-		case 0xAC000000:
-		//get the address value of rs 
-		rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		//get the immediate value and sign extend it
-		immediate_value_decode = (0x0000FFFF & instruction);
-
-		printf("\n immediate_value_decode= 0x%08x", immediate_value_decode);
-
-		immediate_sign_decode = (0x0000FFFF & instruction)>>15; // Masking with 0000 0000 0000 0000 1111 1111 1111 1111
-
-		printf("\n immediate_sign_decode= 0x%08x",immediate_sign_decode );
-			switch(immediate_sign_decode){
-
-			case 0x00000001:
-			immediate_value = (immediate_value_decode | 0Xffff0000);
-			break;
-				
-			case 0x00000000: 
-			immediate_value = (immediate_value_decode | 0X000000000);
-			printf("\n immediate_value = 0x%08x", immediate_value);	
-			break;
+/************************************************************/
+/* Forget every decoded word of the text page holding address */
+/************************************************************/
+void decode_invalidate_page(mips_sim_t *sim, uint32_t address)
+{
+	uint32_t offset = address - MEM_TEXT_BEGIN;
 
-			}
-		
-		uint32_t temp = CURRENT_STATE.REGS[rs] + immediate_value + 0x10010000;
-		printf("\n rs = %d", CURRENT_STATE.REGS[rs]);	
-		printf("\n temp = 0x%08x", temp);			
-		printf("\n value = 0x%08x", CURRENT_STATE.REGS[rt]);	
-		//temp = CURRENT_STATE.REGS[rt];
-		
-		mem_write_32(temp, CURRENT_STATE.REGS[rt]);
-		break;
-		
-			
-		//(SB- Store Byt}e)
-		/*case 0xA0000000:
-		//get the address value of rs 
-		uint32_t rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		uint32_t rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		int32_t offset_value = (0x0000FFFF & instruction); // Masking with 0000 0000 0000 0000 1111 1111 1111 1111(sign extended)
-		int8_t mem_write_32(CURRENT_STATE.REGS[rs] + offset_value) = int8_t(CURRENT_STATE.REGS[rt]) ;
-		break;
-			
-		
-		
-		//(SH- Store Half word)
-		case 0xA4000000:
-		//get the address value of rs 
-		uint32_t rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		uint32_t rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		int32_t offset_value = (0x0000FFFF & instruction); // Masking with 0000 0000 0000 0000 1111 1111 1111 1111(sign extended)
-		int16_t mem_write_32(CURRENT_STATE.REGS[rs] + offset_value) = int16_t(CURRENT_STATE.REGS[rt]) ;
-		break;
-		
-		
-		*/	
-		/***************--(BEQ- Branch on Equal)*****************/
-		case 0x10000000:
-		//get the address value of rs 
-		rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		immediate_value_decode = (0x0000FFFF & instruction);
-		immediate_sign_decode = (0x0000FFFF & instruction)>>15; // Masking with 0000 0000 0000 0000 1111 1111 1111 1111
-			switch(immediate_sign_decode){
-
-			case 0x00000001:
-			immediate_value = (immediate_value_decode | 0Xffff0000);
-			break;
-				
-			case 0x00000000: 
-			immediate_value = (immediate_value_decode | 0X000000000);
-			break;
-				
-			}
-				
-		offset_value = (immediate_value) << 2; // Masking with 0000 0000 0000 0000 1111 1111 1111 1111(sign extended)
+	if (offset > MEM_TEXT_END - MEM_TEXT_BEGIN || sim->DECODE_CACHE[offset >> MEM_PAGE_SHIFT] == NULL) {
+		return;
+	}
+	/* blocks point into the records about to be freed */
+	block_flush(sim);
+	free(sim->DECODE_CACHE[offset >> MEM_PAGE_SHIFT]);
+	sim->DECODE_CACHE[offset >> MEM_PAGE_SHIFT] = NULL;
+}
 
-			if (CURRENT_STATE.REGS[rs] == CURRENT_STATE.REGS[rt])
-			{
-				NEXT_STATE.PC = (CURRENT_STATE.PC + offset_value) ;
-			}
-			else 
-			{
-				NEXT_STATE.PC = (CURRENT_STATE.PC + 4);
-			}						
-		
-		break;
-		
-		
-		
-		/*****************--(BNE- Branch on not Equal)***************/
-		case 0x14000000:
-		//get the address value of rs 
-		rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		immediate_value_decode = (0x0000FFFF & instruction);
-		immediate_sign_decode = (0x0000FFFF & instruction)>>15; // Masking with 0000 0000 0000 0000 1111 1111 1111 1111
-			switch(immediate_sign_decode){
-
-			case 0x00000001:
-			immediate_value = (immediate_value_decode | 0Xffff0000);
-			break;
-				
-			case 0x00000000: 
-			immediate_value = (immediate_value_decode | 0X000000000);
-			break;
+/************************************************************/
+/* Print the fields of the instruction about to execute     */
+/************************************************************/
+void trace_instruction(mips_sim_t *sim, const decoded_inst_t *d)
+{
+	uint32_t opcode = (0xFC000000 & d->instruction);
+
+	TRACE(sim, TRACE_INSTRUCTION, "[0x%08x] Instruction = %08x\n", sim->CURRENT_STATE.PC, d->instruction);
+	if (opcode == 0x00000000) {
+		TRACE(sim, TRACE_FIELDS, "\tOpcode = 0x%08x rs = %d rt = %d rd = %d sa = %d function = 0x%08x\n",
+		      opcode, d->rs, d->rt, d->rd, d->shamt, (0x0000003F & d->instruction));
+	} else {
+		TRACE(sim, TRACE_FIELDS, "\tOpcode = 0x%08x rs = %d rt = %d immediate = 0x%08x\n",
+		      opcode, d->rs, d->rt, d->imm);
+	}
+	TRACE(sim, TRACE_VERBOSE, "\tR%d = 0x%08x R%d = 0x%08x HI = 0x%08x LO = 0x%08x\n",
+	      d->rs, sim->CURRENT_STATE.REGS[d->rs], d->rt, sim->CURRENT_STATE.REGS[d->rt], sim->CURRENT_STATE.HI, sim->CURRENT_STATE.LO);
+}
 
-			}
-		
-		offset_value = (immediate_value)<< 2; // Masking with 0000 0000 0000 0000 1111 1111 1111 1111(sign extended)
-			if (CURRENT_STATE.REGS[rs] != CURRENT_STATE.REGS[rt])
-			{
-				NEXT_STATE.PC = (CURRENT_STATE.PC + offset_value) ;
-			}
-			else 
-			{
-			
-				NEXT_STATE.PC = (CURRENT_STATE.PC + 4) ;
-			}						
-		
-		break;
-		
-		
-		//(BLEZ- Branch on less than or Equal to zero)
-		/*case 0x18000000:
-		//get the address value of rs 
-		uint32_t rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		uint32_t rt = (0x001F0000 & instruction) >> 16printf("\n This is a R-type instruction");
-		//get the address value of rs 
-		rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-	        rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		//get the address value of rd
-		rd = (0x0000F800 & instruction) >> 11;//Masking with 0000 0000 0000 0000 1111 1000 0000 0000 (0000F800)
-		printf("\n rd = %d", rd);
-		;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = 0x%08x", rt);
-		
-		int32_t offset_value = (0x0000FFFF & instruction)<< 2; // Masking with 0000 0000 0000 0000 1111 1111 1111 1111(sign extended)
-		if (CURRENT_STATE.REGS[rs] < =  uint32_t(0))
-		{
-			NEXT_STATE.PC = (CURRENT_STATE.PC + offset_value) ;
-		}
-		else 
-		{
-			NEXT_STATE.PC = (CURRENT_STATE.PC + 4) ;
-		}						
-		
-		break;
-		
-		
-		//(BLTZ- Branch on less than zero)
-		case 0x04000000:
-		//get the address value of rs 
-		uint32_t rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		uint32_t rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = 0x%08x", rt);
-		
-		int32_t offset_value = (0x0000FFFF & instruction)<< 2; // Masking with 0000 0000 0000 0000 1111 1111 1111 1111(sign extended)
-		if (CURRENT_STATE.REGS[rs] < uint32_t(0) && uint32_t rt == 0x00000000)
-		{
-			NEXT_STATE.PC = (CURRENT_STATE.PC + offset_value) ;
-		}
-		else 
-		{
-			NEXT_STATE.PC = (CURRENT_STATE.PC + 4) ;
-		}						
-		
-		break;
-		
-		
-		//(BGEZ- Branch on Greater than or equal to zero)
-		case 0x04000000:
-		//get the address value of rs 
-		uint32_t rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		uint32_t rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		int32_t offset_value = (0x0000FFFF & instruction)<< 2; // Masking with 0000 0000 0000 0000 1111 1111 1111 1111(sign extended)
-		if (CURRENT_STATE.REGS[rs] > =  uint32_t(0) && uint32_t rt == 0x00000001 )
-		{
-			NEXT_STATE.PC = (CURRENT_STATE.PC + offset_value) ;
+/************************************************************/
+/* Buffered trace sink: one write per buffer, not per field */
+/************************************************************/
+void trace_printf(mips_sim_t *sim, const char *format, ...)
+{
+	va_list args;
+	int length;
+
+	if (sim->TRACE_USED > TRACE_BUFFER_SIZE - TRACE_LINE_MAX) {
+		trace_flush(sim);
+	}
+	va_start(args, format);
+	length = vsnprintf(sim->TRACE_BUFFER + sim->TRACE_USED, TRACE_BUFFER_SIZE - sim->TRACE_USED, format, args);
+	va_end(args);
+	if (length > 0) {
+		sim->TRACE_USED += (size_t)length < TRACE_BUFFER_SIZE - sim->TRACE_USED ? (size_t)length : TRACE_BUFFER_SIZE - sim->TRACE_USED - 1;
+	}
+}
+
+void trace_flush(mips_sim_t *sim)
+{
+	if (sim->TRACE_USED) {
+		fwrite(sim->TRACE_BUFFER, 1, sim->TRACE_USED, stdout);
+		sim->TRACE_USED = 0;
+	}
+}
+
+/************************************************************/
+/* decode and execute instruction                                                                     */ 
+/************************************************************/
+/* branches and jumps, the instructions the branch predictors see */
+static int op_is_control(uint8_t op)
+{
+	return OP_CLASS[op] == CLASS_BRANCH || OP_CLASS[op] == CLASS_JUMP;
+}
+
+void handle_instruction(mips_sim_t *sim)
+{
+	/* execute one instruction at a time. Use/update CURRENT_STATE and and NEXT_STATE, as necessary.*/
+	uint32_t pc = sim->CURRENT_STATE.PC;
+	const decoded_inst_t *d = decode_fetch(sim, pc);
+	/* handlers read every source before writing and take branch targets from the record,
+	 * so they can write straight into CURRENT_STATE */
+	CPU_State *next = sim->STATE_IN_PLACE ? &sim->CURRENT_STATE : &sim->NEXT_STATE;
+
+	if (TRACE_LEVEL > TRACE_OFF) {
+		trace_instruction(sim, d);
+	}
+
+	next->PC = pc + 4;
+	d->handler(sim, d, &sim->CURRENT_STATE, next);
+	if (sim->PROFILE) {
+		profile_count(sim, pc, 1);
+	}
+	perf_count(&sim->PERF, d->op, pc + 4, next->PC);
+
+	if (sim->NUM_BPRED && op_is_control(d->op)) {
+		bpred_resolve(sim, d, pc, next->PC);
+	}
+	/* cycle() counts this instruction once it returns */
+	if (sim->CALLGRAPH && OP_CLASS[d->op] == CLASS_JUMP) {
+		callgraph_jump(sim, d, pc, next->PC, sim->INSTRUCTION_COUNT + 1);
+	}
+}
+
+/************************************************************/
+/* Threaded engine: jump from each handler straight to the next */
+/************************************************************/
+uint32_t run_threaded(mips_sim_t *sim, uint32_t max_instructions)
+{
+	/* executes in place on CURRENT_STATE; the handlers are written so that is safe */
+	CPU_State *state = &sim->CURRENT_STATE;
+	const decoded_inst_t *d;
+	uint32_t remaining = max_instructions;
+	uint64_t base = sim->INSTRUCTION_COUNT;
+	perf_counters_t perf = sim->PERF;
+	const int profiling = sim->PROFILE;
+	uint32_t fall_through;
+
+#if defined(__GNUC__)
+	/* one indirect jump per handler, so each gets its own branch-predictor history */
+#define OP_LABEL(name) &&do_##name,
+	static void *labels[NUM_OPS] = { MIPS_OPS(OP_LABEL) };
+#define DISPATCH() \
+	do { \
+		if (remaining == 0 || sim->RUN_FLAG == FALSE) goto done; \
+		remaining--; \
+		d = decode_fetch(sim, state->PC); \
+		if (profiling) profile_count(sim, state->PC, 1); \
+		state->PC += 4; \
+		goto *labels[d->op]; \
+	} while (0)
+/* OP_##name is a constant, so each body keeps only its own class's counting, and only
+ * MFC0 brings the counters up to date before it runs */
+#define OP_BODY(name) \
+	do_##name: \
+	if (OP_##name == OP_mfc0) { \
+		sim->INSTRUCTION_COUNT = base + max_instructions - remaining - 1; \
+		sim->PERF = perf; \
+	} \
+	fall_through = state->PC; \
+	op_##name(sim, d, state, state); \
+	perf_count(&perf, OP_##name, fall_through, state->PC); \
+	DISPATCH();
+
+	DISPATCH();
+	MIPS_OPS(OP_BODY)
+done:
+#undef OP_BODY
+#undef DISPATCH
+#undef OP_LABEL
+#else
+	while (remaining && sim->RUN_FLAG) {
+		remaining--;
+		d = decode_fetch(sim, state->PC);
+		if (profiling) {
+			profile_count(sim, state->PC, 1);
 		}
-		else 
-		{
-			NEXT_STATE.PC = (CURRENT_STATE.PC + 4) ;
-		}						uint32_t rs;
-		uint32_t rt;
-		uint32_t rd;
-		
-		break;
-
-		
-		
-		//(BGTZ- Branch on Greater than zero)
-		case 0x1C000000:
-		//get the address value of rs 
-		uint32_t rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		uint32_t rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = 0x%08x", rt);
-		
-		int32_t offset_value = (0x0000FFFF & instruction)<< 2; // Masking with 0000 0000 0000 0000 1111 1111 1111 1111(sign extended)
-		if (CURRENT_STATE.REGS[rs] > =  uint32_t(0) && uint32_t rt == 0x00000001 )
-		{
-			NEXT_STATE.PC = (CURRENT_STATE.PC + offset_value) ;
+		if (d->op == OP_mfc0) {
+			sim->INSTRUCTION_COUNT = base + max_instructions - remaining - 1;
+			sim->PERF = perf;
 		}
-		else 
-		{
-			NEXT_STATE.PC = (CURRENT_STATE.PC + 4) ;
-		}						
-		
-		break;
-
-         	*/
-
-		/********************************************************************J-Type*******************************************************************/
-
-		/**************--(Jump Instruction)*******************************/
-		case 0x08000000:
-		// determine the upper(31-28)opecode bit 
-		Op_upper = (0xf00000000 & instruction); // This is to get the upper 4 bit of the opcode
-		
-		// determine the target value ie 26 down to 0 bit
-		target_value = (0x07FFFFFF & instruction) << 2; // Masking with 0000 0111 1111 1111 1111 1111 1111 1111. (This is to get the 26 bit of the instruction)
-		 
-		NEXT_STATE.PC = (Op_upper | target_value);
-		break;
-		
-		
-		//(Jump and link instruction)
-		/*case: 0x0C000000
-		NEXT_STATE.REGS[31] = CURRENT_STATE.PC + 8;
-		// determine the upper(31-28)opecode bit 
-		uint32_t Op_upper =  (0xf00000000 & instruction); // This is to get the upper 4 bit of the opcode
-		
-		// determine the target value ie 26 down to 0 bit
-		uint32_t target_value = (0x07FFFFFF & instruction)<< 2; // Masking with 0000 0111 1111 1111 1111 1111 1111 1111. (This is to get the 26 bit of the instruction)
-		 
-		NEXT_STATE.PC = (op_upper | target_value);
-		break;
-	
-		*/	
-		
+		fall_through = state->PC += 4;
+		d->handler(sim, d, state, state);
+		perf_count(&perf, d->op, fall_through, state->PC);
 	}
-NEXT_STATE.PC = (CURRENT_STATE.PC + 4);
+#endif
 
+	sim->NEXT_STATE = sim->CURRENT_STATE;
+	sim->INSTRUCTION_COUNT = base + max_instructions - remaining;
+	sim->PERF = perf;
+	return max_instructions - remaining;
 }
 
 
 /************************************************************/
 /* Initialize Memory                                                                                                    */ 
 /************************************************************/
-void initialize() { 
-	init_memory();
-	CURRENT_STATE.PC = MEM_TEXT_BEGIN;
-	NEXT_STATE = CURRENT_STATE;
-	RUN_FLAG = TRUE;
+void initialize(mips_sim_t *sim) { 
+	init_memory(sim);
+	sim->CURRENT_STATE.PC = MEM_TEXT_BEGIN;
+	sim->NEXT_STATE = sim->CURRENT_STATE;
+	sim->RUN_FLAG = TRUE;
+	sim->HEAP_BREAK = MEM_HEAP_BEGIN;
+}
+
+/************************************************************/
+/* Allocate a simulator with default options; the caller sets prog_file and loads it */
+/************************************************************/
+mips_sim_t *sim_create()
+{
+	mips_sim_t *sim = calloc(1, sizeof(mips_sim_t));
+
+	if (sim == NULL) {
+		printf("Error: out of memory creating a simulator\n");
+		exit(-1);
+	}
+	sim->ENGINE = ENGINE_INTERP;
+	sim->STATE_IN_PLACE = TRUE;
+	sim->PIPE_FORWARDING = TRUE;
+	initialize(sim);
+	return sim;
+}
+
+/************************************************************/
+/* Release a simulator and everything it allocated          */
+/************************************************************/
+void sim_destroy(mips_sim_t *sim)
+{
+	uint32_t i;
+
+	trace_flush(sim);
+	syscall_free(sim);
+	block_flush(sim);
+	jit_free(sim);
+	bpred_free(sim);
+	callgraph_free(sim);
+	reverse_free(sim);
+	elf_unmap(sim);
+	free(sim->MEM_FILE_PAGES);
+	free(sim->MEM_FILE_DATA);
+	for (i = 0; i < MEM_TEXT_PAGES; i++) {
+		free(sim->DECODE_CACHE[i]);
+		free(sim->BLOCK_MAP[i]);
+		free(sim->PROFILE_COUNTS[i]);
+	}
+	for (i = 0; i < sim->MEM_NUM_DIRTY; i++) {
+		free(sim->MEM_PAGES[sim->MEM_DIRTY_PAGES[i]]);
+	}
+	for (i = 0; i < sim->MEM_NUM_FREE; i++) {
+		free(sim->MEM_FREE_PAGES[i]);
+	}
+	free(sim->MEM_DIRTY_PAGES);
+	free(sim->MEM_FREE_PAGES);
+	free(sim);
 }
 
 /************************************************************/
 /* Print the program loaded into memory (in MIPS assembly format)    */ 
 /************************************************************/
-void print_program(){
+void print_program(mips_sim_t *sim){
 	int i;
 	uint32_t addr;
 	
-	for(i=0; i<PROGRAM_SIZE; i++){
-		addr = MEM_TEXT_BEGIN + (i*4);
-		printf("\n [0x%x]\t \n", addr);
-		print_instruction(addr);
+	for(i=0; i<sim->PROGRAM_SIZE; i++){
+		addr = sim->PROGRAM_START + (i*4);
+		printf("[0x%08x]\t", addr);
+		print_instruction(sim, addr);
 	}
 }
 
 /************************************************************/
 /* Print the instruction at given memory address (in MIPS assembly format)    */
 /************************************************************/
-void print_instruction(uint32_t addr){
-	/*IMPLEMENT THIS*/
-	uint32_t rs;
-	uint32_t rt;
-	uint32_t rd;
-	uint32_t immediate_value;
-	uint32_t immediate_value_unsign;
-	uint32_t offset_value;
-	uint32_t Op_upper;
-	uint32_t target_value;
-	uint32_t immediate_sign_decode;
-	uint32_t immediate_value_decode;
-	//uint32_t immediate_value_lui;
-	uint32_t instruction = mem_read_32(addr);
-	
-	//print the instruction
-	printf("\nInstruction = 0x%08x ", instruction);
-	
-	//Decode the opcode from the instruction
-	uint32_t opcode = (0xFC000000 & instruction); //masking the instruction with 1111 1100 0000 0000 0000 0000 0000 0000 (FC000000)
-	
-	printf("\nOpcode = 0x%08x ",opcode);
-	
-	switch (opcode) {
-		/**************************************************R-Type*****************************************************************************/
-		case 0x00000000:
-		printf("\n R-type");
-	       
-		//get the address value of rs 
-		rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-	        rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		//get the address value of rd
-		rd = (0x0000F800 & instruction) >> 11;//Masking with 0000 0000 0000 0000 1111 1000 0000 0000 (0000F800)
-		printf("\n rd = %d", rd);
-		
-		//get the value of shift amount
-		uint32_t sa = (0x000007C0 & instruction) >> 6;//Masking with 0000 0000 0000 0000 0000 0111 1100 0000 (000007C0) 
-		printf("\n sa = %d", sa);
-		      
-		//decoding the function bit
-		uint32_t function = (0x0000003F & instruction); //Masking with 0000 0000 0000 0000 0000 0000 0011 1111 (0000003F)
-		printf("\n function = 0x%08x", function);
-		
-				switch (function) {
-		
-				//ADD Instruction
-				case 0x00000020:
-				printf("\n Add R%d, R%d, R%d ", rd, rs, rt);
-				break;
-	
-				//ADDU function
-				case 0x00000021:
-				printf("\n Addu R%d, R%d, R%d ", rd, rs, rt);
-				break;	
-					
-			    	//SUB function
-				case 0x00000022:
-				printf("\n Sub R%d, R%d, R%d ", rd, rs, rt);
-				break;
-					
-					
-				//SUBU function
-				case 0x00000023:
-				printf("\n Subu R%d, R%d, R%d ", rd, rs, rt);
-				break;
-					
-					
-				//AND function
-				case 0x00000024:
-				printf("\n And R%d, R%d, R%d ", rd, rs, rt );
-				break;
-					
-				//OR function
-				case 0x00000025:
-				printf("\n Or R%d, R%d, R%d ",  rd, rs, rt );
-				break;
-					
-				//XOR function (if rs and rt is different, rd = 1 else if rs and rt are same then rd is 0)
-				case 0x00000026:
-				printf("\n Xor R%d, R%d, R%d ", rd, rs, rt );
-				break;
-					
-				//NOR function ( !(rs or rt) )
-				case 0x00000027:
-				printf("\n Nor R%d, R%d, R%d ", rd, rs, rt);
-				break;
-					
-				//SLT function (Set on Less Than, if rs < rt then rd = 1, if rs > rt then rd = 0)
-				case 0x0000002A:
-				printf("\n Slt R%d, R%d, R%d ", rd, rs, rt);
-				break;	
-					
-				//--SLL function (Shift Left Logical)
-				case 0x00000000:
-				printf("\n Sll R%d, R%d, %d ", rd, rs, sa);
-				break;
-					
-				//SRL function (Shit Right Logical)
-				case 0x00000002:
-				printf("\n Srl R%d, R%d, %d ", rd, rs, sa);
-				break;
-					
-				//SRA function (Shift Right Arithmetic)
-				case 0x00000003:
-				printf("\n Sra R%d, R%d, %d ", rd, rs, sa);
-				break;
-				
-				// system call
-				case 0x0000000c:
-				printf("\n c \n");
-				break;
-					
-			        //MULT function (Multiply)
-				/*case 0x00000018:
-				printf("\n This is a multiply function");
-				break;
-					
-				//MULTU (Multiply unisgned)
-				case 0x00000019:
-				printf("\n This is a multiply unsinged function");
-		                break;
-					
-				//DIV (Divide function)
-				case 0x0000001A:
-				printf("\n This is a divide function");
-				break;
-					
-				//DIVU (Divide unsigned function)
-				case 0x0000001B:
-				printf("\n This is a divide unsigned function");
-				break;
-				
-				//Load/Store instruction 
-					
-				//MFHI function (Move from HI)
-				case 0x00000010:
-				printf("\n This is an MFHI function");
-				break;
-					
-				//MFLO function (Move From LO)
-				case 0x00000012:
-				printf("\n This is an MFLO function");
-				break;
-					
-				//MTHI function (Move To HI)
-				case 0x00000011:
-				printf("\n This is an MTHI function");
-				break;
-					
-				//MTLO function (Move To LO)
-				case 0x00000013:
-				printf("\n This is an MTLO function");
-				break;
-					
-				//Control Flow Instructions
-				//JR function (Jump Register)
-				case 0x00000008:
-				printf("\n This is an JR function"); 
-				break;
-					
-				//JALR function (Jump And Link Register)
-				case 0x00000009:
-				printf("\n This is an JALR function"); 
-				break;
-				*/		
-			} //End of inner switch (function of R-type)
-		break; // Break for R-type case
-       		
-		
-
-		/******************************************************I-Type***********************************************************************/
-					
-		// (ADDI - Add immediate )
-		case  0x20000000:
-		//get the address value of rs 
-		rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		//get the immediate value and sign extend it
-		immediate_value_decode = (0x0000FFFF & instruction);
-		immediate_sign_decode = (0x0000FFFF & instruction)>>15; // Masking with 0000 0000 0000 0000 1111 1111 1111 1111
-			switch(immediate_sign_decode) {
-			case 0x00000001:
-			immediate_value = (immediate_value_decode | 0Xffff0000);
-			break;
+void print_instruction(mips_sim_t *sim, uint32_t addr){
+	uint32_t instruction = mem_read_32(sim, addr);
+	const inst_info_t *info = inst_lookup(instruction);
+	decoded_inst_t d;
+
+	//same tables as execution, so the listing shows exactly what will run
+	decode_instruction(addr, instruction, &d);
+
+	printf("%s", info->mnemonic);
+	switch (info->syntax) {
+		case SYNTAX_WORD:         printf(" 0x%08x", instruction); break;
+		case SYNTAX_RD_RS_RT:     printf(" R%d, R%d, R%d", d.rd, d.rs, d.rt); break;
+		case SYNTAX_RD_RT_SA:     printf(" R%d, R%d, %d", d.rd, d.rt, d.shamt); break;
+		case SYNTAX_RS_RT:        printf(" R%d, R%d", d.rs, d.rt); break;
+		case SYNTAX_RD:           printf(" R%d", d.rd); break;
+		case SYNTAX_RS:           printf(" R%d", d.rs); break;
+		case SYNTAX_RD_RS:        printf(" R%d, R%d", d.rd, d.rs); break;
+		case SYNTAX_RT_RS_IMM:    printf(" R%d, R%d, %d", d.rt, d.rs, (int32_t)d.imm); break;
+		case SYNTAX_RT_IMM:       printf(" R%d, 0x%04x", d.rt, 0x0000FFFF & instruction); break;
+		case SYNTAX_RT_OFFSET_RS: printf(" R%d, %d(R%d)", d.rt, (int32_t)d.imm, d.rs); break;
+		case SYNTAX_RS_RT_TARGET: printf(" R%d, R%d, 0x%08x", d.rs, d.rt, d.imm); break;
+		case SYNTAX_RS_TARGET:    printf(" R%d, 0x%08x", d.rs, d.imm); break;
+		case SYNTAX_TARGET:       printf(" 0x%08x", d.imm); break;
+		case SYNTAX_RT_CP0:       printf(" R%d, $%d, %d", d.rt, d.rd, instruction & 7); break;
+	}
+	printf("\n");
+}
 
-			case 0x00000000: 
-			immediate_value = (immediate_value_decode | 0X000000000);
-			break;
+/************************************************************/
+/* Does this operation end a basic block?                   */
+/************************************************************/
+static int op_ends_block(uint8_t op)
+{
+	return op_is_control(op) || OP_CLASS[op] == CLASS_SYSCALL;
+}
+
+/************************************************************/
+/* Find (or build) the basic block starting at pc           */
+/************************************************************/
+block_t *block_lookup(mips_sim_t *sim, uint32_t pc)
+{
+	uint32_t offset = pc - MEM_TEXT_BEGIN;
+	block_t **slots, *b;
+	const decoded_inst_t *d;
+
+	//blocks only cover the text segment
+	if (offset > MEM_TEXT_END - MEM_TEXT_BEGIN || (pc & 3)) {
+		return NULL;
+	}
+
+	slots = sim->BLOCK_MAP[offset >> MEM_PAGE_SHIFT];
+	if (slots == NULL) {
+		slots = calloc(DECODE_SLOTS, sizeof(block_t *));
+		if (slots == NULL) {
+			printf("Error: out of memory building block at 0x%08x\n", pc);
+			exit(-1);
+		}
+		sim->BLOCK_MAP[offset >> MEM_PAGE_SHIFT] = slots;
+	}
+	if (slots[(offset & MEM_PAGE_MASK) >> 2]) {
+		return slots[(offset & MEM_PAGE_MASK) >> 2];
+	}
+
+	b = calloc(1, sizeof(block_t));
+	if (b == NULL) {
+		printf("Error: out of memory building block at 0x%08x\n", pc);
+		exit(-1);
+	}
+	b->start = pc;
+	b->insts = decode_fetch(sim, pc);
+	/* a block stops after a branch, jump or syscall, or at the end of its page so that
+	 * its records are contiguous in one DECODE_CACHE page; it also stops before an MFC0,
+	 * which then starts a block and reads counters that are up to date */
+	do {
+		d = decode_fetch(sim, pc + 4 * b->length);
+		b->length++;
+		b->loads += OP_CLASS[d->op] == CLASS_LOAD;
+		b->stores += OP_CLASS[d->op] == CLASS_STORE;
+	} while (!op_ends_block(d->op) && b->length < BLOCK_MAX_LENGTH &&
+		 ((pc + 4 * b->length) & MEM_PAGE_MASK) != 0 &&
+		 decode_fetch(sim, pc + 4 * b->length)->op != OP_mfc0);
+	b->exit = OP_CLASS[d->op];
+	b->reads_counters = b->insts[0].op == OP_mfc0;
+
+	b->next_allocated = sim->BLOCK_LIST;
+	sim->BLOCK_LIST = b;
+	slots[(offset & MEM_PAGE_MASK) >> 2] = b;
+	return b;
+}
+
+/************************************************************/
+/* Throw away every block, e.g. after the text was rewritten */
+/************************************************************/
+void block_flush(mips_sim_t *sim)
+{
+	block_t *b, *next;
+	uint32_t offset;
+
+	profile_fold_blocks(sim);
+	for (b = sim->BLOCK_LIST; b != NULL; b = next) {
+		next = b->next_allocated;
+		offset = b->start - MEM_TEXT_BEGIN;
+		sim->BLOCK_MAP[offset >> MEM_PAGE_SHIFT][(offset & MEM_PAGE_MASK) >> 2] = NULL;
+		free(b);
+	}
+	sim->BLOCK_LIST = NULL;
+	sim->BLOCKS_STALE = FALSE;
+	jit_flush(sim);
+}
+
+/************************************************************/
+/* Block engine: run whole basic blocks, chained to their successors */
+/************************************************************/
+uint32_t run_blocks(mips_sim_t *sim, uint32_t max_instructions)
+{
+	/* executes in place on CURRENT_STATE, like the threaded engine */
+	CPU_State *state = &sim->CURRENT_STATE;
+	block_t *b, *prev = NULL;
+	const decoded_inst_t *d;
+	uint32_t remaining = max_instructions;
+	uint32_t i, length, pc;
+	uint64_t base = sim->INSTRUCTION_COUNT;
+	perf_counters_t perf = sim->PERF;
+
+	while (remaining && sim->RUN_FLAG) {
+		/* text was rewritten, by the last block or before the run: block shapes may no longer hold */
+		if (sim->BLOCKS_STALE) {
+			block_flush(sim);
+			prev = NULL;
+		}
+
+		/* follow the chain from the previous block before falling back to the map */
+		if (prev && prev->succ[0] && prev->succ[0]->start == state->PC) {
+			b = prev->succ[0];
+		} else if (prev && prev->succ[1] && prev->succ[1]->start == state->PC) {
+			b = prev->succ[1];
+		} else if ((b = block_lookup(sim, state->PC)) != NULL) {
+			if (prev) {
+				prev->succ[state->PC == prev->start + 4 * prev->length ? 0 : 1] = b;
 			}
-		printf("\n Addi R%d, R%d, %d ", rt, rs, immediate_value ); 	
-		break;
-						
-						
-		//(ADDIU- Add immediate unisigned)
-		case 0x24000000:
-		//get the address value of rs 
-		rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		immediate_value_unsign = (0x0000FFFF & instruction);
-		printf("\n Addiu R%d, R%d, %d \n", rt, rs, immediate_value_unsign );
-		break;
-						
-						
-		//(ANDI- AND immediate)
-		case 0x30000000:
-		//get the address value of rs 
-		rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		immediate_value_unsign = (0x0000FFFF & instruction);
-		printf("\n Andi R%d, R%d, %d ", rt, rs, immediate_value_unsign );
-		break;
-						
-		
-		//(ORI- OR immediate)
-		case 0x34000000:
-		//get the address value of rs 
-		rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		immediate_value_unsign = (0x0000FFFF & instruction);
-		printf("\n Ori R%d, R%d, %d ", rt, rs, immediate_value_unsign );
-		break;
-		
-		
-		//(XORI- Exclusive OR immediate)
-		case 0x38000000:
-		//get the address value of rs 
-		rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		immediate_value_unsign = (0x0000FFFF & instruction);
-		printf("\n Xori R%d, R%d, %d ", rt, rs, immediate_value_unsign );
-		break;
-						
-					
-		/*//(SLTI- Set on less than immediate)
-		case 0x28000000:
-				printf("\n This is an SLTI function");	
-				break;
-		*/			
-					
-		//--(LW- Load Word)
-		case 0x8C000000:
-		//get the address value of rs 
-		rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		//get the immediate value and sign extend it
-		immediate_value_decode = (0x0000FFFF & instruction);
-		immediate_sign_decode = (0x0000FFFF & instruction)>>15; // Masking with 0000 0000 0000 0000 1111 1111 1111 1111
-			switch(immediate_sign_decode){
-			case 0x00000001:
-			immediate_value = (immediate_value_decode | 0Xffff0000);
-				break;
-				
-			case 0x00000000: 
-			immediate_value = (immediate_value_decode | 0X000000000);
-				break;
+		} else {
+			/* outside the text segment: one instruction at a time */
+			pc = state->PC;
+			d = decode_fetch(sim, pc);
+			if (d->op == OP_mfc0) {
+				sim->INSTRUCTION_COUNT = base + max_instructions - remaining;
+				sim->PERF = perf;
 			}
-		printf("\n Lw R%d, %d(R%d)", rt, immediate_value , rs);
-		break;
-					
-
-					
-		/*//(LB- Load Byte)
-		case 0x80000000:
-		printf("\n This is an LB function");
-		break;
-					
-						
-		//(LH- Load half word)
-		case 0x84000000:
-		printf("\n This is an LH function");
-		break;	*/
-					
-					
-					
-		//(LUI- Load upper immediate)
-		case 0x3C000000:
-		//get the address value of rs 
-		rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		//get the immediate value and sign extend it
-		immediate_value_decode = (0x0000FFFF & instruction);
-		immediate_sign_decode = (0x0000FFFF & instruction)>>15; // Masking with 0000 0000 0000 0000 1111 1111 1111 1111
-			switch(immediate_sign_decode){
-			case 0x00000001:
-			immediate_value = (immediate_value_decode | 0Xffff0000);
-			break;
-
-			case 0x00000000: 
-			immediate_value = (immediate_value_decode | 0X000000000);
-			break;
+			state->PC += 4;
+			d->handler(sim, d, state, state);
+			perf_count(&perf, d->op, pc + 4, state->PC);
+			if (sim->PROFILE) {
+				profile_count(sim, pc, 1);
 			}
-		printf("\n Lui R%d, %d", rt, immediate_value);
-		break;	
-						
-					
-		//(SW- Store word)
-		case 0xAC000000:
-		//get the address value of rs 
-		rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		//get the immediate value and sign extend it
-		immediate_value_decode = (0x0000FFFF & instruction);
-		immediate_sign_decode = (0x0000FFFF & instruction)>>15; // Masking with 0000 0000 0000 0000 1111 1111 1111 1111
-			switch(immediate_sign_decode){
-			case 0x00000001:
-			immediate_value = (immediate_value_decode | 0Xffff0000);
-			break;
+			if (sim->NUM_BPRED && op_is_control(d->op)) {
+				bpred_resolve(sim, d, pc, state->PC);
+			}
+			remaining--;
+			if (sim->CALLGRAPH && OP_CLASS[d->op] == CLASS_JUMP) {
+				callgraph_jump(sim, d, pc, state->PC, base + max_instructions - remaining);
+			}
+			prev = NULL;
+			continue;
+		}
 
-			case 0x00000000: 
-			immediate_value = (immediate_value_decode | 0X000000000);
-			break;
+		/* run <n> may end in the middle of a block */
+		length = b->length < remaining ? b->length : remaining;
+
+		if (sim->ENGINE == ENGINE_JIT && b->native == NULL && length == b->length &&
+		    ++b->exec_count == JIT_THRESHOLD) {
+			jit_compile(sim, b);
+		}
+
+		/* an MFC0 only ever starts a block */
+		if (b->reads_counters) {
+			sim->INSTRUCTION_COUNT = base + max_instructions - remaining;
+			sim->PERF = perf;
+		}
+
+		if (b->native && length == b->length) {
+			/* translated code may stop early after a store into text */
+			length = b->native(sim);
+		} else {
+			/* only the last instruction of a block can change the PC and handlers never read
+			 * it, so the fall-through address is stored once for the whole block */
+			state->PC = b->start + 4 * length;
+			for (i = 0; i < length; i++) {
+				b->insts[i].handler(sim, &b->insts[i], state, state);
 			}
-		printf("\n Sw R%d, %d(R%d) ", rt, immediate_value, rs);
-		break;	
-						
-					
-						
-	       /*//(SB- Store Byte)
-		case 0xA0000000:
-		printf("\n This is an SB function");
-		break;	
-				
-			
-		//(SH- Store Half word)
-		case 0xA4000000:
-		printf("\n This is an SH function");
-		break;*/	
-					
-					
-		//(BEQ- Branch on Equal)
-		case 0x10000000:
-		//get the address value of rs 
-		rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		immediate_value_decode = (0x0000FFFF & instruction);
-		immediate_sign_decode = (0x0000FFFF & instruction)>>15; // Masking with 0000 0000 0000 0000 1111 1111 1111 1111
-			switch(immediate_sign_decode){
-			case 0x00000001:
-			immediate_value = (immediate_value_decode | 0Xffff0000);
-			break;
-				
-			case 0x00000000: 
-			immediate_value = (immediate_value_decode | 0X000000000);
-			break;
+		}
+		remaining -= length;
+		prev = b;
+
+		/* a whole execution is one add here; the words get it when the profile is read,
+		 * and only the last instruction can be a branch, jump or syscall */
+		if (length == b->length) {
+			b->profile_count += sim->PROFILE;
+			perf.LOADS += b->loads;
+			perf.STORES += b->stores;
+			if (b->exit == CLASS_BRANCH) {
+				perf.BRANCHES_TAKEN += state->PC != b->start + 4 * length;
+				perf.BRANCHES_NOT_TAKEN += state->PC == b->start + 4 * length;
+			} else if (b->exit == CLASS_JUMP) {
+				perf.JUMPS++;
+			} else if (b->exit == CLASS_SYSCALL) {
+				perf.SYSCALLS++;
 			}
-		printf("\n Beq R%d, R%d, %d ", rt, rs, immediate_value);
-		break;	
-					
-					
-		//(BNE- Branch on not Equal)
-		case 0x14000000:
-		//get the address value of rs 
-		rs = (0x03E00000 & instruction) >> 21;//Masking with 0000 0011 1110 0000 0000 0000 0000 0000 (03E00000)
-		printf("\n rs = %d", rs);
-		
-		//get the address value of rt
-		rt = (0x001F0000 & instruction) >> 16;//Masking with 0000 0000 0001 1111 0000 0000 0000 0000 (001F0000)
-		printf("\n rt = %d", rt);
-		
-		immediate_value_decode = (0x0000FFFF & instruction);
-		immediate_sign_decode = (0x0000FFFF & instruction)>>15; // Masking with 0000 0000 0000 0000 1111 1111 1111 1111
-			switch(immediate_sign_decode){
-			case 0x00000001:
-			immediate_value = (immediate_value_decode | 0Xffff0000);
-			break;
-				
-			case 0x00000000: 
-			immediate_value = (immediate_value_decode | 0X000000000);
-			break;
+		} else {
+			if (sim->PROFILE) {
+				profile_count_block(sim, b, length, 1);
 			}
-		printf("\n Bne R%d, R%d, %d ", rt, rs, immediate_value);
-		break;	
-
-					
-					
-		/*//(BLEZ- Branch on less than or Equal to zero)
-		case 0x18000000:
-		printf("\n This is an BLEZ function");
-		break;
-			
-			
-			
-		//(BLTZ- Branch on less than zero)
-		case 0x04000000:
-		printf("\n This is an BLTZ function");
-		break;	
-			
-			
-		//(BGEZ- Branch on Greater than or equal to zero)
-		case 0x04000000:
-		printf("\n This is an BGEZ function");
-		break;
-			
-			
-		//(BGTZ- Branch on Greater than zero)
-		case 0x1C000000:
-		printf("\n This is an BGTZ function");
-		break;	
-		*/
-				
-		/*******************************************************************J-Type************************************************************/
-		
-		//(Jump Instruction)
-		case 0x08000000:
-		// determine the upper(31-28)opecode bit 
-		Op_upper = (0xf00000000 & instruction); // This is to get the upper 4 bit of the opcode
-		
-		// determine the target value ie 26 down to 0 bit
-		target_value = (0x07FFFFFF & instruction) << 2; // Masking with 0000 0111 1111 1111 1111 1111 1111 1111. (This is to get the 26 bit of the instruction)
-		printf("\n J 0x%08x", target_value );
-		break;	
-					
-					
-		/*//(Jump and link instruction)
-		case: 0x0C000000
-		printf("\n This is an JAL function");
-		break;	*/
-	}	
-	
+			for (i = 0; i < length; i++) {
+				perf_count(&perf, b->insts[i].op, 0, 0);
+			}
+		}
+
+		/* only a block's last instruction can be a branch, so predictors cost one test per block */
+		if (sim->NUM_BPRED && length == b->length && op_is_control(b->insts[length - 1].op)) {
+			bpred_resolve(sim, &b->insts[length - 1], b->start + 4 * (length - 1), state->PC);
+		}
+		if (sim->CALLGRAPH && length == b->length && OP_CLASS[b->insts[length - 1].op] == CLASS_JUMP) {
+			callgraph_jump(sim, &b->insts[length - 1], b->start + 4 * (length - 1), state->PC,
+				       base + max_instructions - remaining);
+		}
+	}
+
+	sim->NEXT_STATE = sim->CURRENT_STATE;
+	sim->INSTRUCTION_COUNT = base + max_instructions - remaining;
+	sim->PERF = perf;
+	return max_instructions - remaining;
+}
+
+/***************************************************************/
+/* Pick the execution engine by name; returns FALSE if unknown   */
+/***************************************************************/
+int select_engine(mips_sim_t *sim, const char *name) {
+	static const char *names[] = { "interp", "threaded", "block", "jit", "pipeline" };
+	int i;
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (strcmp(name, names[i]) == 0) {
+			sim->ENGINE = i;
+			return TRUE;
+		}
+	}
+	printf("Error: unknown engine %s\n", name);
+	return FALSE;
 }
 
 /***************************************************************/
 /* main                                                                                                                                   */
 /***************************************************************/
 int main(int argc, char *argv[]) {                              
+	mips_sim_t *sim = sim_create();
+	int batch = FALSE, threads = 0;
+	const char *sweep_table = NULL, *record_log = NULL, *replay_log = NULL;
+	uint32_t max_instructions = 0;
+
+	/* options come before the program file; the simulator holds them, and batch
+	 * mode copies them into each of its own */
+	int arg = 1;
+	while (arg < argc && argv[arg][0] == '-') {
+		if (strcmp(argv[arg], "-e") == 0 && arg + 1 < argc && select_engine(sim, argv[arg + 1])) {
+			arg += 2;
+		} else if (strcmp(argv[arg], "-copy") == 0) {
+			sim->STATE_IN_PLACE = FALSE;
+			arg++;
+		} else if (strcmp(argv[arg], "-noforward") == 0) {
+			sim->PIPE_FORWARDING = FALSE;
+			arg++;
+		} else if (strcmp(argv[arg], "-time") == 0) {
+			sim->SHOW_HOST_TIME = TRUE;
+			arg++;
+		} else if (strcmp(argv[arg], "-profile") == 0) {
+			sim->PROFILE = TRUE;
+			arg++;
+		} else if (strcmp(argv[arg], "-calls") == 0 && arg + 1 < argc) {
+			sim->CALLGRAPH_FILE = argv[arg + 1];
+			arg += 2;
+		} else if (strcmp(argv[arg], "-reverse") == 0 && arg + 1 < argc) {
+			sim->REVERSE_INTERVAL = strtoul(argv[arg + 1], NULL, 0);
+			arg += 2;
+		} else if (strcmp(argv[arg], "-record") == 0 && arg + 1 < argc) {
+			record_log = argv[arg + 1];
+			arg += 2;
+		} else if (strcmp(argv[arg], "-replay") == 0 && arg + 1 < argc) {
+			replay_log = argv[arg + 1];
+			arg += 2;
+		} else if (strcmp(argv[arg], "-bp") == 0 && arg + 1 < argc) {
+			sim->BPRED_SPEC = argv[arg + 1];
+			arg += 2;
+		} else if (strcmp(argv[arg], "-btb") == 0 && arg + 1 < argc) {
+			sim->BTB_ENTRIES = strtoul(argv[arg + 1], NULL, 0);
+			arg += 2;
+		} else if (strcmp(argv[arg], "-sample") == 0 && arg + 2 < argc) {
+			sim->SAMPLE_SKIP = strtoul(argv[arg + 1], NULL, 0);
+			sim->SAMPLE_WINDOW = strtoul(argv[arg + 2], NULL, 0);
+			arg += 3;
+		} else if (strcmp(argv[arg], "-batch") == 0) {
+			batch = TRUE;
+			arg++;
+		} else if (strcmp(argv[arg], "-sweep") == 0 && arg + 1 < argc) {
+			sweep_table = argv[arg + 1];
+			arg += 2;
+		} else if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc) {
+			threads = atoi(argv[arg + 1]);
+			arg += 2;
+		} else if (strcmp(argv[arg], "-max") == 0 && arg + 1 < argc) {
+			max_instructions = strtoul(argv[arg + 1], NULL, 0);
+			arg += 2;
+		} else {
+			break;
+		}
+	}
+
+	/* the engine given with -e fast-forwards between the timed windows */
+	if (sim->SAMPLE_WINDOW && sim->ENGINE == ENGINE_PIPELINE) {
+		printf("Error: -sample times its windows on the pipeline; pick a functional engine with -e\n");
+		exit(1);
+	}
+
+	/* the threaded engine never stops between instructions to show the predictors a branch */
+	if (sim->BPRED_SPEC && sim->ENGINE == ENGINE_THREADED) {
+		printf("Error: -bp needs the interp, block, jit or pipeline engine\n");
+		exit(1);
+	}
+	if (sim->BPRED_SPEC && !bpred_init(sim)) {
+		exit(1);
+	}
+	/* batch workers are quiet and print only their summaries */
+	if (sim->PROFILE && (batch || sweep_table)) {
+		printf("Error: -profile can't be used with -batch or -sweep\n");
+		exit(1);
+	}
+	/* ... nor to show the call graph a jump */
+	if (sim->CALLGRAPH_FILE && sim->ENGINE == ENGINE_THREADED) {
+		printf("Error: -calls needs the interp, block, jit or pipeline engine\n");
+		exit(1);
+	}
+	if (sim->CALLGRAPH_FILE && (batch || sweep_table)) {
+		printf("Error: -calls can't be used with -batch or -sweep\n");
+		exit(1);
+	}
+	if (sim->CALLGRAPH_FILE) {
+		callgraph_init(sim);
+	}
+
+	/* stepping back would leave the shadow call stack describing a future that never happens */
+	if (sim->REVERSE_INTERVAL && sim->CALLGRAPH_FILE) {
+		printf("Error: -reverse can't be used with -calls\n");
+		exit(1);
+	}
+	/* and batch has no front end to step back from */
+	if (sim->REVERSE_INTERVAL && (batch || sweep_table)) {
+		printf("Error: -reverse can't be used with -batch or -sweep\n");
+		exit(1);
+	}
+	if (sim->REVERSE_INTERVAL) {
+		reverse_init(sim);
+	}
+
+	if (batch && arg < argc) {
+		int status = run_batch(sim, argc - arg, argv + arg, threads, max_instructions);
+		sim_destroy(sim);
+		return status;
+	}
+
+	if (sweep_table && arg == argc - 1) {
+		int status;
+		snprintf(sim->prog_file, sizeof(sim->prog_file), "%s", argv[arg]);
+		status = run_sweep(sim, sweep_table, threads, max_instructions);
+		sim_destroy(sim);
+		return status;
+	}
+
+	/* the log names the program; one given after it takes its place */
+	if (replay_log && arg >= argc - 1) {
+		int status = replay_run(sim, replay_log, arg < argc ? argv[arg] : NULL);
+		if (status) {
+			exit_reports(sim);
+		}
+		sim_destroy(sim);
+		return status ? 0 : 1;
+	}
+
+	if (arg != argc - 1) {
+		printf("Error: You should provide input file.\nUsage: %s [-e interp|threaded|block|jit|pipeline] [-copy] [-noforward] [-sample <skip> <window>] [-time] [-profile]\n"
+		       "       [-bp <predictor>[:<bits>],... ] [-btb <entries>] [-calls <folded stacks file>] [-record <log>]\n"
+		       "       [-reverse <checkpoint interval>] <input program> \n"
+		       "       %s -replay <log> [<input program>]\n"
+		       "       %s -batch [-j <threads>] [-max <instructions>] [-e ...] [-copy] <input program>...\n"
+		       "       %s -sweep <variant table> [-j <threads>] [-max <instructions>] [-e ...] [-copy] <input program>\n\n",
+		       argv[0], argv[0], argv[0], argv[0]);
+		exit(1);
+	}
+
 	printf("\n**************************\n");
 	printf("Welcome to MU-MIPS SIM...\n");
 	printf("**************************\n\n");
-	
-	if (argc < 2) {
-		printf("Error: You should provide input file.\nUsage: %s <input program> \n\n",  argv[0]);
+
+	snprintf(sim->prog_file, sizeof(sim->prog_file), "%s", argv[arg]);
+	if (!load_program(sim)) {
+		exit(-1);
+	}
+	if (sim->CALLGRAPH) {
+		callgraph_reset(sim);	/* the root is the entry point just loaded */
+	}
+	if (record_log && !record_open(sim, record_log)) {
 		exit(1);
 	}
-
-	strcpy(prog_file, argv[1]);
-	initialize();
-	load_program();
 	help();
 	while (1){
-		handle_command();
+		handle_command(sim);
 	}
 	return 0;
 }
@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <stdint.h>
 
 #define FALSE 0
@@ -9,6 +10,8 @@
 #define MEM_TEXT_BEGIN  0x00400000
 #define MEM_TEXT_END      0x0FFFFFFF
 /*Memory address 0x10000000 to 0x1000FFFF access by $gp*/
+#define MEM_GP_BEGIN    0x10000000
+#define MEM_GP_END      0x1000FFFF
 #define MEM_DATA_BEGIN  0x10010000
 #define MEM_DATA_END   0x7FFFFFFF
 
@@ -22,20 +25,25 @@
 #define MEM_STACK_BEGIN 0x7FFFFFFF
 #define MEM_STACK_END  0x10010000
 
+/* sbrk hands out the data segment from here up, as in SPIM, leaving the top 16 MB to the stack */
+#define MEM_HEAP_BEGIN  0x10040000
+#define MEM_HEAP_END   0x7EFFFFFF
+
+/* guest memory is handed out in pages, allocated the first time they are written */
+#define MEM_PAGE_SHIFT 12
+#define MEM_PAGE_SIZE  (1 << MEM_PAGE_SHIFT)
+#define MEM_PAGE_MASK  (MEM_PAGE_SIZE - 1)
+#define MEM_NUM_PAGES  (1 << (32 - MEM_PAGE_SHIFT))
+
 typedef struct {
 	uint32_t begin, end;
-	uint8_t *mem;
 } mem_region_t;
 
-/* memory will be dynamically allocated at initialization */
-mem_region_t MEM_REGIONS[] = {
-	{ MEM_TEXT_BEGIN, MEM_TEXT_END, NULL },
-	{ MEM_DATA_BEGIN, MEM_DATA_END, NULL },
-	{ MEM_KDATA_BEGIN, MEM_KDATA_END, NULL },
-	{ MEM_KTEXT_BEGIN, MEM_KTEXT_END, NULL }
-};
+#define NUM_MEM_REGION 5
+
+/* where each simulator's MEM_REGIONS start out */
+extern const mem_region_t DEFAULT_MEM_REGIONS[NUM_MEM_REGION];
 
-#define NUM_MEM_REGION 4
 #define MIPS_REGS 32
 
 typedef struct CPU_State_Struct {
@@ -46,36 +54,389 @@ typedef struct CPU_State_Struct {
 } CPU_State;
 
 
+/* one complete simulation: every function below takes the one it works on */
+typedef struct mips_sim_struct mips_sim_t;
+
+
+/***************************************************************/
+/* Predecoded instructions                                                                                              */
+/***************************************************************/
+typedef struct decoded_inst_struct decoded_inst_t;
+
+/* every operation the handlers implement, kept in one list so the threaded engine's
+ * dispatch table is generated from the same names as the handlers */
+#define MIPS_OPS(X) \
+	X(nop) X(nop_load) X(add) X(sub) X(and) X(or) X(xor) X(nor) X(slt) X(sll) X(srl) X(sra) \
+	X(mult) X(multu) X(div) X(divu) X(mfhi) X(mflo) X(mthi) X(mtlo) \
+	X(addi) X(slti) X(andi) X(ori) X(xori) X(lui) \
+	X(lw) X(lb) X(lh) X(sw) X(sb) X(sh) \
+	X(beq) X(bne) X(blez) X(bgtz) X(bltz) X(bgez) X(j) X(jal) X(jr) X(jalr) X(syscall) \
+	X(mfc0)
+
+#define MIPS_OP_ENUM(name) OP_##name,
+enum { MIPS_OPS(MIPS_OP_ENUM) NUM_OPS };
+
+/* instruction classes from the class column of mips-isa.def */
+enum { CLASS_ALU, CLASS_HILO, CLASS_LOAD, CLASS_STORE, CLASS_BRANCH, CLASS_JUMP, CLASS_SYSCALL };
+
+/* OP_* -> CLASS_* */
+extern const uint8_t OP_CLASS[NUM_OPS];
+
+/* Executes one decoded instruction. The caller sets next->PC to the fall-through address
+ * beforehand and control-flow handlers overwrite it. Handlers never read cur->PC and read
+ * all their sources before writing, so cur and next may point at the same state. */
+typedef void (*inst_handler_t)(mips_sim_t *sim, const decoded_inst_t *d, const CPU_State *cur, CPU_State *next);
+
+struct decoded_inst_struct {
+	inst_handler_t handler;	/* NULL until the word has been decoded */
+	uint32_t instruction;	/* raw word, kept for tracing */
+	uint32_t imm;		/* extended immediate; absolute target for branches and jumps */
+	uint8_t rs, rt, rd, shamt;
+	uint8_t op;		/* OP_* index of handler */
+};
+
+#define MEM_TEXT_PAGES (((MEM_TEXT_END - MEM_TEXT_BEGIN) >> MEM_PAGE_SHIFT) + 1)
+#define DECODE_SLOTS   (MEM_PAGE_SIZE / 4)
+
+/***************************************************************/
+/* Basic blocks                                                                                                                */
+/***************************************************************/
+#define BLOCK_MAX_LENGTH 64
+#define JIT_THRESHOLD    64	/* full executions before a block is translated to host code */
+
+/* translated block: runs it on state, sets the PC and returns the instructions retired */
+typedef uint32_t (*jit_fn_t)(mips_sim_t *sim);
+
+typedef struct block_struct block_t;
+struct block_struct {
+	uint32_t start;			/* PC of the first instruction */
+	uint32_t length;		/* instructions, only the last of which may branch */
+	const decoded_inst_t *insts;	/* the block's records, contiguous in its DECODE_CACHE page */
+	block_t *succ[2];		/* chained successors: fall-through and taken */
+	uint32_t exec_count;		/* full executions, until the block is translated */
+	jit_fn_t native;		/* host code for the block, NULL if interpreted */
+	uint64_t profile_count;		/* full executions not yet added to PROFILE_COUNTS */
+	uint8_t loads, stores;		/* counted into PERF once per full execution */
+	uint8_t exit;			/* CLASS_* of the last instruction, counted with them */
+	uint8_t reads_counters;		/* starts with an MFC0, which needs PERF up to date */
+	block_t *next_allocated;	/* every live block, for flushing */
+};
+
+/***************************************************************/
+/* Tracing                                                                                                                      */
+/***************************************************************/
+/* How much the interpreter prints per instruction, fixed at build time (make TRACE_LEVEL=n).
+ * At TRACE_OFF every TRACE() is a constant-false branch and the compiler drops it. */
+#define TRACE_OFF         0
+#define TRACE_INSTRUCTION 1	/* PC and instruction word */
+#define TRACE_FIELDS      2	/* plus the decoded fields */
+#define TRACE_VERBOSE     3	/* plus the source register values */
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_OFF
+#endif
+
+#define TRACE_BUFFER_SIZE (64 * 1024)
+#define TRACE_LINE_MAX    256	/* longest single trace_printf() */
+
+#define TRACE(sim, level, ...) \
+	do { \
+		if (TRACE_LEVEL >= (level)) { \
+			trace_printf(sim, __VA_ARGS__); \
+		} \
+	} while (0)
+
+/* execution engines */
+#define ENGINE_INTERP   0	/* cycle() per instruction, with tracing */
+#define ENGINE_THREADED 1	/* computed-goto dispatch straight between handlers */
+#define ENGINE_BLOCK    2	/* whole basic blocks per dispatch, chained together */
+#define ENGINE_JIT      3	/* block engine, translating hot blocks to x86-64 */
+#define ENGINE_PIPELINE 4	/* one instruction at a time, timed through a five-stage pipeline */
+
+/***************************************************************/
+/* Pipeline timing                                                                                                          */
+/***************************************************************/
+enum { PIPE_IF, PIPE_ID, PIPE_EX, PIPE_MEM, PIPE_WB, PIPE_STAGES };
+
+/* HI and LO are tracked for hazards after the 32 general registers */
+#define PIPE_HI   MIPS_REGS
+#define PIPE_LO   (MIPS_REGS + 1)
+#define PIPE_REGS (MIPS_REGS + 2)
+
+typedef struct {
+	uint64_t STAGE[PIPE_STAGES];	/* cycle the last instruction entered each stage */
+	uint64_t REDIRECT;		/* earliest fetch after a taken branch or jump */
+	uint64_t READY[PIPE_REGS];	/* first cycle each register's newest value can be used in EX */
+	uint8_t FROM_LOAD[PIPE_REGS];	/* ... and whether a load produces it */
+	uint64_t INSTRUCTIONS;
+	uint64_t DATA_STALLS, LOAD_USE_STALLS;
+	uint64_t CONTROL_STALLS, FLUSHES;
+
+	/* sampling */
+	uint32_t SAMPLE_POS;		/* instructions into the current skip + window period */
+	uint64_t WINDOWS;
+	uint64_t UNTIMED_CYCLES;	/* STAGE[] offsets added when a window starts, not pipeline time */
+} pipe_state_t;
+
+/* branch predictor, see mu-mips-bpred.c */
+typedef struct bpred_struct bpred_t;
+/* call tree, see mu-mips-callgraph.c */
+typedef struct callgraph_struct callgraph_t;
+/* reverse execution checkpoints, see mu-mips-reverse.c */
+typedef struct reverse_struct reverse_t;
 
 /***************************************************************/
-/* CPU State info.                                                                                                               */
+/* Performance counters                                                                                                */
 /***************************************************************/
+/* CP0 registers MFC0 reads; anything else reads as 0 */
+#define CP0_COUNT   9	/* low word of INSTRUCTION_COUNT */
+#define CP0_PERFCNT 25	/* select n: counter n of perf_counters_t, low word */
 
-CPU_State CURRENT_STATE, NEXT_STATE;
-int RUN_FLAG;	/* run flag*/
-uint32_t INSTRUCTION_COUNT;
-uint32_t PROGRAM_SIZE; /*in words*/
+/* what the retired instructions did, since the last reset; every engine keeps these
+ * exact, the block engine by adding a block's worth at once */
+typedef struct {
+	uint64_t LOADS, STORES;
+	uint64_t BRANCHES_TAKEN, BRANCHES_NOT_TAKEN;
+	uint64_t JUMPS, SYSCALLS;
+	uint64_t HOST_NS;	/* host wall time spent running; the guest can't read it, so runs stay deterministic */
+} perf_counters_t;
 
-char prog_file[32];
+/***************************************************************/
+/* Front-end commands, as handle_command() parses them and record/replay logs them */
+/***************************************************************/
+enum {
+	CMD_SIM, CMD_RUN, CMD_RDUMP, CMD_RESET, CMD_INPUT, CMD_HIGH, CMD_LOW,
+	CMD_MDUMP, CMD_PRINT, CMD_PROFILE, CMD_HELP, CMD_QUIT, CMD_RSTEP, CMD_RCONTINUE, NUM_CMDS
+};
+
+typedef struct {
+	int kind;		/* CMD_* */
+	uint32_t arg[2];	/* run, rstep: instructions; input: register, value; high, low: value; mdump: start, stop */
+} command_t;
+
+/***************************************************************/
+/* Simulator context                                                                                                         */
+/***************************************************************/
+/* Nothing here is shared between simulators, so one process can hold any number of them
+ * and run each on its own thread. The tables are sized for the whole address space but
+ * sim_create() callocs the context, so only the parts a program touches use memory. */
+struct mips_sim_struct {
+	/* CPU state first: translated code addresses it relative to the context */
+	CPU_State CURRENT_STATE, NEXT_STATE;
+	int RUN_FLAG;		/* run flag*/
+	int ENGINE;		/* which execution engine run() and runAll() use */
+	int STATE_IN_PLACE;	/* interp: write CURRENT_STATE directly instead of copying NEXT_STATE over it each cycle (-copy turns it off) */
+	int QUIET;		/* batch mode: load_program() doesn't list every word */
+	int PIPE_FORWARDING;	/* pipeline: forward results to EX instead of waiting for WB (-noforward turns it off) */
+	uint32_t SAMPLE_SKIP;	/* sampling: instructions run on ENGINE between timed windows */
+	uint32_t SAMPLE_WINDOW;	/* sampling: instructions timed on the pipeline per window, 0 when off */
+	const char *BPRED_SPEC;	/* -bp list of branch predictors, NULL when off */
+	uint32_t BTB_ENTRIES;	/* -btb: per-predictor branch target buffer, 0 for none */
+	uint64_t INSTRUCTION_COUNT;
+	perf_counters_t PERF;
+	int SHOW_HOST_TIME;	/* -time: rdump adds PERF.HOST_NS, which differs from run to run */
+	uint32_t PROGRAM_START;	/* first word of the loaded text */
+	uint32_t PROGRAM_SIZE;	/*in words*/
+	char prog_file[256];
+	char LOAD_ERROR[128];	/* why the last load failed, for batch summaries */
+
+	/* the regions only bound which addresses may be backed by a page */
+	mem_region_t MEM_REGIONS[NUM_MEM_REGION];
+
+	/* page table over the whole 32-bit address space: guest page number -> host page (NULL until written) */
+	uint8_t *MEM_PAGES[MEM_NUM_PAGES];
+
+	/* the same for stores: NULL until the page is private to this simulator, so the first
+	 * write to a page shared with IMAGE goes through mem_map_page() and copies it */
+	uint8_t *MEM_WRITE_PAGES[MEM_NUM_PAGES];
+
+	/* loaded simulator whose pages reset() maps instead of reloading prog_file (sweep mode);
+	 * it must not run or change while other simulators share it */
+	const mips_sim_t *IMAGE;
+
+	/* pages mapped since the last reset, i.e. the only ones reset has to clear */
+	uint32_t *MEM_DIRTY_PAGES;
+	uint32_t MEM_NUM_DIRTY, MEM_DIRTY_CAPACITY;
+
+	/* pages cleared by reset, kept zeroed for reuse instead of going back to malloc */
+	uint8_t **MEM_FREE_PAGES;
+	uint32_t MEM_NUM_FREE;
+
+	/* an ELF prog_file stays mapped while loaded; its whole pages are read straight from the
+	 * mapping and copied on first write like IMAGE's. MEM_FILE_PAGES is in ascending order,
+	 * MEM_FILE_DATA the page of the mapping behind each */
+	uint8_t *PROGRAM_MAP;
+	size_t PROGRAM_MAP_SIZE;
+	uint32_t *MEM_FILE_PAGES;
+	uint8_t **MEM_FILE_DATA;
+	uint32_t MEM_NUM_FILE, MEM_FILE_CAPACITY;
+
+	/* text page -> one decoded record per word, allocated the first time the page is executed */
+	decoded_inst_t *DECODE_CACHE[MEM_TEXT_PAGES];
+	decoded_inst_t UNCACHED;	/* decode_fetch() result outside the text segment */
+
+	/* text page -> block starting at each word, parallel to DECODE_CACHE */
+	block_t **BLOCK_MAP[MEM_TEXT_PAGES];
+
+	/* text page -> times each word executed, parallel to DECODE_CACHE and allocated with it */
+	uint64_t *PROFILE_COUNTS[MEM_TEXT_PAGES];
+	uint64_t PROFILE_OUTSIDE;	/* instructions run outside the text segment */
+	int PROFILE;			/* -profile: count every instruction run, and print the profile when the simulator quits */
+	block_t *BLOCK_LIST;
+	int BLOCKS_STALE;	/* the guest wrote its own text since the blocks were built */
+
+	/* host code for this simulator's translated blocks */
+	uint8_t *JIT_BUFFER;
+	uint32_t JIT_USED;
+	int JIT_UNAVAILABLE;	/* the host refused executable memory; blocks stay interpreted */
+
+	/* pipeline engine timing since the last reset */
+	pipe_state_t PIPE;
+
+	/* predictors built from BPRED_SPEC; the engines only look at them when NUM_BPRED is set */
+	bpred_t *BPRED;
+	int NUM_BPRED;
+
+	/* shadow call stack and call tree, NULL unless -calls asked for them */
+	callgraph_t *CALLGRAPH;
+	const char *CALLGRAPH_FILE;	/* -calls: folded stacks are written here at exit */
+
+	/* -record appends every command and outside value to RECORD_FILE; -replay reads them back */
+	FILE *RECORD_FILE, *REPLAY_FILE;
+
+	/* syscalls: guest output waiting for syscall_flush(), the sbrk break and the exit2 code */
+	char *GUEST_OUTPUT;
+	size_t GUEST_OUTPUT_USED;
+	FILE *GUEST_OUT;	/* where guest output goes, stdout when NULL */
+	int NO_GUEST_INPUT;	/* batch: read_int sees end of input, since every worker shares stdin */
+	uint32_t HEAP_BREAK;
+	int EXIT_CODE;
+
+	/* checkpoints for rstep and rcontinue, NULL unless -reverse gave their interval */
+	reverse_t *REVERSE;
+	uint32_t REVERSE_INTERVAL;
+
+	char TRACE_BUFFER[TRACE_BUFFER_SIZE];
+	size_t TRACE_USED;
+};
+
+
+/* count n executions of the instruction at pc; only text words have counters */
+static inline void profile_count(mips_sim_t *sim, uint32_t pc, uint64_t n)
+{
+	uint32_t offset = pc - MEM_TEXT_BEGIN;
+
+	if (offset > MEM_TEXT_END - MEM_TEXT_BEGIN || (pc & 3)) {
+		sim->PROFILE_OUTSIDE += n;
+	} else {
+		sim->PROFILE_COUNTS[offset >> MEM_PAGE_SHIFT][(offset & MEM_PAGE_MASK) >> 2] += n;
+	}
+}
+
+/* count the loads, stores and control transfers among retired instructions; op went from
+ * the PC before fall_through to next_pc. The fast engines count into a local copy of PERF,
+ * which stays in registers, and store it back before an MFC0 and at the end of the run. */
+static inline void perf_count(perf_counters_t *p, int op, uint32_t fall_through, uint32_t next_pc)
+{
+	switch (OP_CLASS[op]) {
+		case CLASS_LOAD:    p->LOADS++; break;
+		case CLASS_STORE:   p->STORES++; break;
+		case CLASS_BRANCH:
+			p->BRANCHES_TAKEN += next_pc != fall_through;
+			p->BRANCHES_NOT_TAKEN += next_pc == fall_through;
+			break;
+		case CLASS_JUMP:    p->JUMPS++; break;
+		case CLASS_SYSCALL: p->SYSCALLS++; break;
+	}
+}
 
 
 /***************************************************************/
 /* Function Declerations.                                                                                                */
 /***************************************************************/
 void help();
-uint32_t mem_read_32(uint32_t address);
-void mem_write_32(uint32_t address, uint32_t value);
-void cycle();
-void run(int num_cycles);
-void runAll();
-void mdump(uint32_t start, uint32_t stop) ;
-void rdump();
-void handle_command();
-void reset();
-void init_memory();
-void load_program();
-void handle_instruction(); /*IMPLEMENT THIS*/
-void initialize();
-void print_program(); /*IMPLEMENT THIS*/
-void print_instruction(uint32_t);
-
+mips_sim_t *sim_create();
+void sim_destroy(mips_sim_t *sim);
+uint32_t mem_read_32(mips_sim_t *sim, uint32_t address);
+void mem_write_32(mips_sim_t *sim, uint32_t address, uint32_t value);
+uint8_t mem_read_8(mips_sim_t *sim, uint32_t address);
+void mem_write_8(mips_sim_t *sim, uint32_t address, uint8_t value);
+uint16_t mem_read_16(mips_sim_t *sim, uint32_t address);
+void mem_write_16(mips_sim_t *sim, uint32_t address, uint16_t value);
+void cycle(mips_sim_t *sim);
+void run(mips_sim_t *sim, int num_cycles);
+void runAll(mips_sim_t *sim);
+void run_to_completion(mips_sim_t *sim, uint32_t max_instructions);
+uint32_t run_engine(mips_sim_t *sim, uint32_t max_instructions);
+void mdump(mips_sim_t *sim, uint32_t start, uint32_t stop) ;
+void rdump(mips_sim_t *sim);
+void handle_command(mips_sim_t *sim);
+void execute_command(mips_sim_t *sim, const command_t *c);
+int reset(mips_sim_t *sim);
+void init_memory(mips_sim_t *sim);
+void free_memory(mips_sim_t *sim);
+uint8_t *mem_map_page(mips_sim_t *sim, uint32_t address);
+const uint8_t *mem_initial_page(const mips_sim_t *sim, uint32_t page);
+void mem_write_block(mips_sim_t *sim, uint32_t address, const uint8_t *data, uint32_t size);
+int load_failed(mips_sim_t *sim, const char *format, ...);
+int load_program(mips_sim_t *sim);
+int load_elf(mips_sim_t *sim);
+void elf_unmap(mips_sim_t *sim);
+void handle_instruction(mips_sim_t *sim); /*IMPLEMENT THIS*/
+void decode_instruction(uint32_t pc, uint32_t instruction, decoded_inst_t *d);
+const decoded_inst_t *decode_fetch(mips_sim_t *sim, uint32_t pc);
+void decode_invalidate(mips_sim_t *sim, uint32_t address);
+void decode_invalidate_page(mips_sim_t *sim, uint32_t address);
+void trace_instruction(mips_sim_t *sim, const decoded_inst_t *d);
+void trace_printf(mips_sim_t *sim, const char *format, ...);
+void trace_flush(mips_sim_t *sim);
+uint32_t run_threaded(mips_sim_t *sim, uint32_t max_instructions);
+block_t *block_lookup(mips_sim_t *sim, uint32_t pc);
+void block_flush(mips_sim_t *sim);
+uint32_t run_blocks(mips_sim_t *sim, uint32_t max_instructions);
+int jit_compile(mips_sim_t *sim, block_t *b);
+void jit_flush(mips_sim_t *sim);
+void jit_free(mips_sim_t *sim);
+uint32_t run_pipeline(mips_sim_t *sim, uint32_t max_instructions);
+uint32_t run_sampled(mips_sim_t *sim, uint32_t max_instructions);
+int bpred_init(mips_sim_t *sim);
+void bpred_reset(mips_sim_t *sim);
+void bpred_free(mips_sim_t *sim);
+int bpred_resolve(mips_sim_t *sim, const decoded_inst_t *d, uint32_t pc, uint32_t next_pc);
+void bpred_report(mips_sim_t *sim, FILE *out);
+void profile_count_block(mips_sim_t *sim, const block_t *b, uint32_t length, uint64_t n);
+void profile_fold_blocks(mips_sim_t *sim);
+void profile_clear(mips_sim_t *sim);
+void profile_report(mips_sim_t *sim);
+void callgraph_init(mips_sim_t *sim);
+void callgraph_reset(mips_sim_t *sim);
+void callgraph_free(mips_sim_t *sim);
+void callgraph_jump(mips_sim_t *sim, const decoded_inst_t *d, uint32_t pc, uint32_t next_pc, uint64_t retired);
+void callgraph_report(mips_sim_t *sim);
+int callgraph_write_folded(mips_sim_t *sim, const char *file);
+int record_open(mips_sim_t *sim, const char *file);
+void record_command(mips_sim_t *sim, const command_t *c);
+void record_close(mips_sim_t *sim);
+uint32_t replay_value(mips_sim_t *sim, uint32_t (*fetch)(mips_sim_t *sim));
+int replay_run(mips_sim_t *sim, const char *file, const char *program);
+void reverse_init(mips_sim_t *sim);
+void reverse_reset(mips_sim_t *sim);
+void reverse_free(mips_sim_t *sim);
+void reverse_page_written(mips_sim_t *sim, uint32_t page);
+uint32_t reverse_chunk(mips_sim_t *sim, uint32_t max_instructions);
+void reverse_note_change(mips_sim_t *sim);
+int reverse_replayed_value(mips_sim_t *sim, uint32_t *value);
+void reverse_keep_value(mips_sim_t *sim, uint32_t value);
+void reverse_step(mips_sim_t *sim, uint32_t n);
+void reverse_continue(mips_sim_t *sim);
+void pipe_report(mips_sim_t *sim, FILE *out);
+void syscall_dispatch(mips_sim_t *sim, const CPU_State *cur, CPU_State *next);
+void syscall_flush(mips_sim_t *sim);
+void syscall_reset(mips_sim_t *sim);
+void syscall_free(mips_sim_t *sim);
+int select_engine(mips_sim_t *sim, const char *name);
+void initialize(mips_sim_t *sim);
+void print_program(mips_sim_t *sim); /*IMPLEMENT THIS*/
+void print_instruction(mips_sim_t *sim, uint32_t);
+int run_batch(const mips_sim_t *options, int num_programs, char **programs, int num_threads, uint32_t max_instructions);
+int run_sweep(mips_sim_t *sim, const char *table_file, int num_threads, uint32_t max_instructions);